@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "adaptive.h"
+
+static variant tier(unsigned eighths, int quality)
+{
+    variant v;
+    v.eighths = eighths;
+    v.quality = quality;
+    return v;
+}
+
+// Native, requantized, half and quarter of the size.
+const std::array<variant, 4> tiers = { variant(), tier(8, 50), tier(4, 50), tier(2, 40) };
+
+static const std::chrono::milliseconds sample_period{ 500 };
+static const std::chrono::milliseconds down_after{ 1000 };
+static const std::chrono::milliseconds min_hold{ 5000 };
+static const std::chrono::milliseconds max_hold{ 60000 };
+
+bool tier_controller::update(const Capture::socket &socket, const std::array<size_t, tiers.size()> &sizes, clock::time_point now)
+{
+    if (sampled == clock::time_point()) {
+        sampled = changed = now;
+        return false;
+    }
+    if (now - sampled < sample_period)
+        return false;
+
+    double seconds = std::chrono::duration<double>(now - sampled).count();
+    sampled = now;
+
+    auto stats = socket.stats();
+    Capture::socket_link link;
+    socket.link(link);
+
+    double offered_rate = offered_bytes / seconds;
+    offered_bytes = 0;
+    size_t new_skipped = stats.frames_skipped - skipped;
+    skipped = stats.frames_skipped;
+    // Acknowledged by the peer, the kernel buffers could hide a slow reader from the queue.
+    double acked_rate = acked_bytes ? (link.bytes_acked - acked_bytes) / seconds : offered_rate;
+    acked_bytes = link.bytes_acked;
+
+    if (link.rtt.count() && (!min_rtt.count() || link.rtt < min_rtt))
+        min_rtt = link.rtt;
+
+    // Frames are skipped, more than half a second is queued, the peer takes less than offered
+    // or the path queue grows.
+    bool behind = new_skipped
+        || (offered_rate > 0 && stats.queued > offered_rate / 2)
+        || acked_rate < 0.8 * offered_rate
+        || (min_rtt.count() && link.rtt > 4 * min_rtt + std::chrono::milliseconds(20));
+
+    if (behind) {
+        if (behind_since == clock::time_point())
+            behind_since = now;
+        // Data queued before the previous change is still draining.
+        if (now - behind_since < down_after || now - changed < 2 * down_after || current + 1 >= tiers.size())
+            return false;
+
+        // Went up too early, next try waits longer.
+        if (now - raised < 2 * hold)
+            hold = std::min(2 * hold, max_hold);
+        ++current;
+        changed = now;
+        behind_since = clock::time_point();
+        return true;
+    }
+
+    behind_since = clock::time_point();
+    if (now - changed > max_hold)
+        hold = std::max(hold / 2, min_hold);
+    if (!current || now - changed < hold)
+        return false;
+
+    // Rate the finer tier needs, unknown until it is sent to somebody.
+    double need = sizes[current] && sizes[current - 1] ? offered_rate * sizes[current - 1] / sizes[current] : 0;
+    double capacity = std::max<double>(link.delivery_rate, acked_rate);
+    // The estimate is exact only when the link limits the rate,
+    // otherwise the link could have more room than measured and the finer tier is probed.
+    if (!link.app_limited && capacity < 1.25 * need)
+        return false;
+
+    --current;
+    changed = raised = now;
+    return true;
+}
+
+const variant &variant_of(const Capture::socket &socket)
+{
+    static const variant native;
+    auto c = static_cast<const client_context *>(socket.context().get());
+    if (!c)
+        return native;
+
+    return c->adaptive ? tiers[c->controller.tier()] : c->requested;
+}
@@ -0,0 +1,63 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef MJPEG_OVER_HTTP_ADAPTIVE_H
+#define MJPEG_OVER_HTTP_ADAPTIVE_H
+
+#include "variant.h"
+#include "pacer.h"
+
+#include <Capture/socket.h>
+
+#include <array>
+#include <chrono>
+
+// Tiers of adaptive clients, coarser with a higher index. Clients of a tier share its frames.
+extern const std::array<variant, 4> tiers;
+
+/**
+ * Moves a client between tiers by its measured throughput: write progress,
+ * skipped frames and TCP_INFO (delivery rate, RTT).
+ * Goes down when the client does not keep up for a second, goes up when the link has room
+ * for the finer tier. A client that went down soon after going up waits longer before the next try.
+ */
+class tier_controller
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    size_t tier() const { return current; }
+    // Bytes offered to the client, even if skipped.
+    void offered(size_t bytes) { offered_bytes += bytes; }
+    // Sizes of the latest frame of every tier, 0 if unknown. Returns true if the tier changed.
+    bool update(const Capture::socket &socket, const std::array<size_t, tiers.size()> &sizes, clock::time_point now);
+
+private:
+    size_t current = 0;
+    clock::time_point sampled;
+    clock::time_point changed;
+    clock::time_point raised;
+    clock::time_point behind_since;
+    std::chrono::milliseconds hold{ 5000 };
+    uint64_t offered_bytes = 0;
+    uint64_t acked_bytes = 0;
+    size_t skipped = 0;
+    std::chrono::microseconds min_rtt{ 0 };
+};
+
+// State of a client, attached to its socket.
+struct client_context
+{
+    variant requested;
+    bool adaptive = false;
+    tier_controller controller;
+    frame_pacer pacer;
+    // Index of the camera of a snapshot client.
+    size_t camera = 0;
+};
+
+// Variant to send to the client: requested or of its tier.
+const variant &variant_of(const Capture::socket &socket);
+
+#endif
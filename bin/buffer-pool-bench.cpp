@@ -0,0 +1,150 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+/**
+ * Counts heap allocations of the network side of mjpeg-over-http: parts are built and queued
+ * by its part_writer to loopback clients that release them once sent, frames come from a buffer_pool.
+ * Pools grow while more frames are in flight than before, frames that reuse buffers are expected
+ * to allocate nothing.
+ *
+ * $ ./buffer-pool-bench [port] [clients] [frames]
+ */
+
+#include "multipart.h"
+
+#include <Capture/socket.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <new>
+#include <thread>
+#include <vector>
+
+static std::atomic<size_t> allocations{ 0 };
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    if (void *p = malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// Reads and drops the stream until the server closes it, slowly so references are released late.
+static void client(int port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    static const char request[] = "GET /stream HTTP/1.0\r\n\r\n";
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || write(fd, request, sizeof(request) - 1) < 0) {
+        perror("client");
+        close(fd);
+        return;
+    }
+
+    char data[16 * 1024];
+    while (read(fd, data, sizeof(data)) > 0)
+        usleep(100);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? strtol(argv[1], NULL, 0) : 8090;
+    size_t count = argc > 2 ? strtol(argv[2], NULL, 0) : 8;
+    size_t frames = argc > 3 ? strtol(argv[3], NULL, 0) : 2000;
+
+    signal(SIGPIPE, SIG_IGN);
+    Capture::socket_listener s;
+    if (!s.listen("127.0.0.1", port)) {
+        fprintf(stderr, "Could not listen on 127.0.0.1:%d\n", port);
+        return 1;
+    }
+
+    std::vector<std::thread> clients;
+    for (size_t i = 0; i < count; ++i)
+        clients.emplace_back(client, port);
+
+    std::vector<Capture::socket> batch;
+    while (batch.size() < count)
+        s.accept([&](auto socket) { batch.push_back(std::move(socket)); });
+
+    part_writer parts;
+    Capture::buffer_pool frame_pool;
+    Capture::send_budget budget;
+    budget.per_connection = 4 << 20;
+    std::string jpeg(64 * 1024, 'j');
+
+    // Allocations of frames that reused pooled buffers and of those that grew the pools.
+    size_t steady = 0, growth = 0, steady_frames = 0;
+    for (size_t sequence = 0; sequence < frames; ++sequence) {
+        size_t before = allocations;
+        size_t pooled = parts.pooled() + frame_pool.size();
+        auto data = frame_pool.get();
+        data->assign(jpeg);
+
+        jpeg_frame frame;
+        frame.data = std::move(data);
+        gettimeofday(&frame.timestamp, nullptr);
+        frame.wall_clock = frame.timestamp;
+        frame.sequence = sequence;
+        auto header = parts.header(frame, sequence);
+
+        size_t size = part_writer::size(*header, frame);
+        for (auto &socket : batch) {
+            if (!socket.flush()) {
+                socket.close();
+                continue;
+            }
+            if (socket.admit(size, budget, part_writer::segments))
+                part_writer::queue(socket, header, frame);
+        }
+
+        size_t n = allocations - before;
+        if (parts.pooled() + frame_pool.size() == pooled) {
+            steady += n;
+            ++steady_frames;
+        } else {
+            growth += n;
+        }
+
+        usleep(500);
+    }
+
+    size_t skipped = 0;
+    for (auto &socket : batch)
+        skipped += socket.stats().frames_skipped;
+
+    printf("Allocations in %zu of %zu frames to %zu clients that reused buffers: %zu\n", steady_frames, frames, count, steady);
+    printf("Allocations growing pools: %zu, pooled headers: %zu, pooled frames: %zu, skipped frames: %zu\n",
+        growth, parts.pooled(), frame_pool.size(), skipped);
+
+    for (auto &socket : batch)
+        socket.close();
+    for (auto &t : clients)
+        t.join();
+
+    return steady ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "encoder.h"
+
+#include <algorithm>
+
+encode_scheduler::encode_scheduler(size_t threads)
+    : threads_count(threads ? threads : std::max(1u, std::thread::hardware_concurrency()))
+{
+}
+
+encode_scheduler::~encode_scheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cond.notify_all();
+    for (auto &t : threads)
+        t.join();
+}
+
+encode_scheduler::queue encode_scheduler::add_source(unsigned priority, std::chrono::milliseconds deadline)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    sources.emplace_back();
+    sources.back().priority = std::max(1u, priority);
+    sources.back().deadline = deadline;
+
+    queue q;
+    q.scheduler = this;
+    q.index = sources.size() - 1;
+    return q;
+}
+
+bool encode_scheduler::queue::run(const std::function<void()> &job) const
+{
+    if (!scheduler) {
+        job();
+        return true;
+    }
+
+    return scheduler->run(index, job);
+}
+
+encode_stats encode_scheduler::queue::stats() const
+{
+    if (!scheduler)
+        return encode_stats();
+
+    std::lock_guard<std::mutex> lock(scheduler->mutex);
+    return scheduler->sources[index].stats;
+}
+
+bool encode_scheduler::run(size_t index, const std::function<void()> &f)
+{
+    job j;
+    j.f = &f;
+    j.queued = clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (threads.empty()) {
+        for (size_t i = 0; i < threads_count; ++i)
+            threads.emplace_back(&encode_scheduler::work, this);
+    }
+
+    auto &s = sources[index];
+    if (s.jobs.empty())
+        s.virtual_time = std::max(s.virtual_time, now);
+    s.jobs.push_back(&j);
+    cond.notify_one();
+
+    done.wait(lock, [&] { return j.done; });
+    return !j.dropped;
+}
+
+void encode_scheduler::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop) {
+        source *next = nullptr;
+        for (auto &s : sources) {
+            if (!s.jobs.empty() && (!next || s.virtual_time < next->virtual_time))
+                next = &s;
+        }
+        if (!next) {
+            cond.wait(lock);
+            continue;
+        }
+
+        auto j = next->jobs.front();
+        next->jobs.pop_front();
+        auto start = clock::now();
+        auto wait = std::chrono::duration_cast<std::chrono::microseconds>(start - j->queued);
+        // At least half of the deadline is left for waiting, even if encoding is slower.
+        std::chrono::microseconds deadline = next->deadline;
+        if (deadline.count() && wait > deadline - std::min(next->encode_avg, deadline / 2)) {
+            ++next->stats.dropped;
+            j->dropped = j->done = true;
+            done.notify_all();
+            continue;
+        }
+
+        // Charged in advance by the usual encode time, other workers pick other sources meanwhile.
+        now = next->virtual_time;
+        auto expected = next->encode_avg;
+        next->virtual_time += double(expected.count()) / next->priority;
+        lock.unlock();
+        (*j->f)();
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+        lock.lock();
+
+        next->virtual_time += double((elapsed - expected).count()) / next->priority;
+        // Moving average of the latest jobs.
+        next->encode_avg = next->encode_avg.count() ? (next->encode_avg * 7 + elapsed) / 8 : elapsed;
+        ++next->stats.encoded;
+        next->stats.wait_sum += wait;
+        next->stats.wait_max = std::max(next->stats.wait_max, wait);
+        next->stats.encode_sum += elapsed;
+        j->done = true;
+        done.notify_all();
+    }
+}
@@ -0,0 +1,100 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef MJPEG_OVER_HTTP_ENCODER_H
+#define MJPEG_OVER_HTTP_ENCODER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct encode_stats
+{
+    size_t encoded = 0;
+    // Jobs that would finish after the deadline.
+    size_t dropped = 0;
+    std::chrono::microseconds wait_sum{ 0 };
+    std::chrono::microseconds wait_max{ 0 };
+    std::chrono::microseconds encode_sum{ 0 };
+};
+
+/**
+ * Runs encoding jobs of all sources, e.g. conversions of raw camera frames to jpeg, on a fixed pool of threads.
+ * Busy workers are shared by sources in proportion to their priorities, by time spent encoding,
+ * so a camera of a larger size does not starve the smaller ones.
+ * A job is dropped instead of being encoded late: if its wait and the usual encode time of the source exceed the deadline,
+ * at least half of the deadline is left for waiting.
+ * Threads are started by the first job.
+ */
+class encode_scheduler
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Jobs of one source, submitted by its threads.
+    class queue
+    {
+    public:
+        // Runs the job on a worker and waits for it, or runs it in place without a scheduler.
+        // Returns false if the job was dropped.
+        bool run(const std::function<void()> &job) const;
+        // Stats since the source was added, like other counters of /stats.
+        encode_stats stats() const;
+
+    private:
+        encode_scheduler *scheduler = nullptr;
+        size_t index = 0;
+        friend class encode_scheduler;
+    };
+
+    // 0 threads is the number of cores.
+    encode_scheduler(size_t threads = 0);
+    ~encode_scheduler();
+
+    // A higher priority gets a larger share, a zero deadline never drops.
+    queue add_source(unsigned priority, std::chrono::milliseconds deadline);
+
+private:
+    encode_scheduler(const encode_scheduler &other) = delete;
+    encode_scheduler &operator=(const encode_scheduler &other) = delete;
+
+    struct job
+    {
+        const std::function<void()> *f = nullptr;
+        clock::time_point queued;
+        bool done = false;
+        bool dropped = false;
+    };
+
+    struct source
+    {
+        unsigned priority = 1;
+        std::chrono::milliseconds deadline{ 0 };
+        std::deque<job *> jobs;
+        // Encode time divided by the priority, the source with the lowest one is next.
+        double virtual_time = 0;
+        std::chrono::microseconds encode_avg{ 0 };
+        encode_stats stats;
+    };
+
+    bool run(size_t index, const std::function<void()> &f);
+    void work();
+
+    size_t threads_count = 0;
+    bool stop = false;
+    // Virtual time of the latest started job, sources that were idle continue from it.
+    double now = 0;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::condition_variable done;
+    std::deque<source> sources;
+    std::vector<std::thread> threads;
+};
+
+#endif
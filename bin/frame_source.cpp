@@ -0,0 +1,322 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "frame_source.h"
+
+#include <Capture/v4l2.h>
+#include <Capture/mjpeg_client.h>
+#include <Capture/jpeg_normalizer.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <algorithm>
+
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <time.h>
+
+// Mean luma of 8x8 blocks, every other line and column are sampled.
+// Luma samples are step bytes apart: 2 in YUYV, 1 in the luma plane of NV12 and NV16.
+static void luma_signature(const Capture::v4l2_frame &frame, const unsigned char *data, size_t stride, size_t step,
+    std::string &output)
+{
+    const size_t cols = frame.width() / 8;
+    const size_t rows = frame.height() / 8;
+    output.resize(cols * rows);
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t c = 0; c < cols; ++c) {
+            unsigned sum = 0;
+            for (size_t y = 0; y < 8; y += 2) {
+                auto line = data + (r * 8 + y) * stride + c * 8 * step;
+                for (size_t x = 0; x < 8 * step; x += 2 * step)
+                    sum += line[x];
+            }
+            output[r * cols + c] = char(sum / 16);
+        }
+    }
+}
+
+// Wall clock time of a CLOCK_MONOTONIC timestamp of the driver.
+static struct timeval wall_clock(const struct timeval &monotonic)
+{
+    struct timespec real, mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    int64_t us = (real.tv_sec - mono.tv_sec + monotonic.tv_sec) * 1000000LL
+        + (real.tv_nsec - mono.tv_nsec) / 1000 + monotonic.tv_usec;
+    return { time_t(us / 1000000), suseconds_t(us % 1000000) };
+}
+
+static std::string fourcc(unsigned f)
+{
+    return { char(f & 0xff), char((f >> 8) & 0xff), char((f >> 16) & 0xff), char((f >> 24) & 0xff) };
+}
+
+static std::string mode_string(const Capture::v4l2_mode &mode)
+{
+    char fps[32];
+    snprintf(fps, sizeof(fps), "%.2f", mode.fps());
+    return fourcc(mode.pixel_format) + " " + std::to_string(mode.width) + "x" + std::to_string(mode.height)
+        + (mode.fps() ? std::string(" ") + fps + " fps" : std::string());
+}
+
+class v4l2_source : public frame_source
+{
+public:
+    v4l2_source(const std::string &device, const capture_options &capture, const encode_scheduler::queue &encoder)
+        : v4l2(device)
+        , capture(capture)
+        , encoder(encoder)
+    {
+        normalizer.set_strip_metadata(capture.strip_metadata);
+    }
+
+    bool start(size_t width, size_t height) override
+    {
+        v4l2.set_latest_only(capture.latest);
+        v4l2.set_frame_rate(capture.fps);
+        v4l2.set_memory(capture.memory);
+        // Motion-JPEG or a raw format, whatever is cheaper for the size and the rate.
+        return v4l2.start(width, height, 0, capture.buffers);
+    }
+
+    bool is_active() const override
+    {
+        return v4l2.is_active();
+    }
+
+    // Every read dequeues a new frame of the device.
+    jpeg_frame read(uint64_t, std::chrono::milliseconds timeout) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        struct pollfd pfd = { v4l2.fd(), POLLIN, 0 };
+        if (poll(&pfd, 1, int(timeout.count())) <= 0)
+            return jpeg_frame();
+
+        auto frame = v4l2.try_read_frame();
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            stats = v4l2.stats();
+        }
+        // Corrupted data is not sent to clients.
+        if (frame.flags() & V4L2_BUF_FLAG_ERROR)
+            return jpeg_frame();
+
+        std::shared_ptr<std::string> signature;
+        // Cheaper from the pixels than from the jpeg later, only needed by change detection.
+        bool raw = frame && capture.signatures;
+        if (raw && frame.pixel_format() == V4L2_PIX_FMT_YUYV) {
+            signature = signatures.get();
+            luma_signature(frame, (const unsigned char *)frame.data(), v4l2.bytes_perline(), 2, *signature);
+        } else if (raw && frame.planes_count() > 1 && frame.plane_stride(0) >= frame.width()
+            && frame.plane_size(0) >= frame.plane_stride(0) * frame.height()) {
+            signature = signatures.get();
+            luma_signature(frame, (const unsigned char *)frame.plane_data(0), frame.plane_stride(0), 1, *signature);
+        }
+        bool camera_jpeg = frame && frame.pixel_format() == V4L2_PIX_FMT_MJPEG;
+        if (frame && !camera_jpeg) {
+            // Skipped if it would be encoded too late.
+            if (!encoder.run([&] { frame = frame.convert(V4L2_PIX_FMT_MJPEG); }))
+                return jpeg_frame();
+        }
+        if (!frame)
+            return jpeg_frame();
+
+        // Buffers are reused once all clients sent them, no allocations in steady state.
+        auto data = pool.get();
+        if (camera_jpeg) {
+            // Trimmed to EOI and completed by Huffman tables while copied, truncated frames are not sent.
+            bool ok = normalizer.normalize(frame.data(), frame.size(), *data);
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                jpeg_stats = normalizer.stats();
+            }
+            if (!ok)
+                return jpeg_frame();
+        } else {
+            data->assign((const char *)frame.data(), frame.size());
+        }
+
+        jpeg_frame r;
+        r.data = std::move(data);
+        r.timestamp = frame.timestamp();
+        if (frame.monotonic_timestamp())
+            r.wall_clock = wall_clock(r.timestamp);
+        else
+            gettimeofday(&r.wall_clock, nullptr);
+        r.sequence = ++sequence;
+        r.received = std::chrono::steady_clock::now();
+        r.signature = std::move(signature);
+        return r;
+    }
+
+    std::string description() const override
+    {
+        std::string d = v4l2.device() + " " + mode_string(v4l2.mode());
+        if (v4l2.pixel_format() != V4L2_PIX_FMT_MJPEG)
+            d += ", converted to jpeg";
+        return d;
+    }
+
+    std::string modes() const override
+    {
+        std::string r;
+        for (auto &mode : v4l2.modes())
+            r += "  " + mode_string(mode) + "\n";
+        return r;
+    }
+
+    std::string report() const override
+    {
+        Capture::v4l2_stats s;
+        Capture::jpeg_normalizer_stats j;
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            s = stats;
+            j = jpeg_stats;
+        }
+        // Lost by the device, dropped while not read, dropped as corrupted, waited for the application.
+        std::string r = "captured: " + std::to_string(s.frames) + " lost by device: " + std::to_string(s.lost)
+            + " dropped unread: " + std::to_string(s.overrun) + " errors: " + std::to_string(s.errors);
+        if (s.latency_count) {
+            r += " dequeue latency avg: " + std::to_string(s.latency_sum.count() / s.latency_count)
+                + " us max: " + std::to_string(s.latency_max.count()) + " us";
+        }
+        r += "\n";
+        if (capture.latest)
+            r += "buffers: " + std::to_string(capture.buffers) + " skipped by latest only: " + std::to_string(s.skipped) + "\n";
+        if (v4l2.pixel_format() == V4L2_PIX_FMT_MJPEG) {
+            return r + "jpeg truncated: " + std::to_string(j.truncated) + " invalid: " + std::to_string(j.invalid)
+                + " huffman inserted: " + std::to_string(j.huffman_inserted) + " trimmed: " + std::to_string(j.trimmed_bytes)
+                + " bytes stripped: " + std::to_string(j.stripped_bytes) + " bytes\n";
+        }
+
+        auto e = encoder.stats();
+        size_t count = std::max<size_t>(e.encoded, 1);
+        return r + "encoded: " + std::to_string(e.encoded) + " dropped: " + std::to_string(e.dropped)
+            + " wait avg: " + std::to_string(e.wait_sum.count() / count) + " us max: " + std::to_string(e.wait_max.count())
+            + " us encode avg: " + std::to_string(e.encode_sum.count() / count) + " us\n";
+    }
+
+private:
+    Capture::v4l2 v4l2;
+    capture_options capture;
+    encode_scheduler::queue encoder;
+    std::mutex mutex;
+    // Read by the report without waiting for the device.
+    mutable std::mutex stats_mutex;
+    Capture::v4l2_stats stats;
+    Capture::jpeg_normalizer_stats jpeg_stats;
+    Capture::jpeg_normalizer normalizer;
+    Capture::buffer_pool pool;
+    Capture::buffer_pool signatures;
+    uint64_t sequence = 0;
+};
+
+/**
+ * Ingests an upstream stream once and keeps only the latest frame.
+ * Received bytes are forwarded untouched, only copied out of the receive buffer.
+ */
+class relay_source : public frame_source
+{
+public:
+    relay_source(const std::string &url)
+        : url(url)
+        , client([this](int, const unsigned char *data, size_t size) { received(data, size); })
+    {
+    }
+
+    ~relay_source()
+    {
+        client.stop();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    bool start(size_t, size_t) override
+    {
+        id = client.add(url);
+        if (id < 0)
+            return false;
+
+        active = true;
+        thread = std::thread([this] { client.run(); active = false; });
+        return true;
+    }
+
+    bool is_active() const override
+    {
+        return active;
+    }
+
+    bool is_relay() const override
+    {
+        return true;
+    }
+
+    jpeg_frame read(uint64_t sequence, std::chrono::milliseconds timeout) override
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        // Clients are not blocked for long, so closed ones are dropped even without upstream frames.
+        cond.wait_for(lock, timeout, [&] { return latest.sequence > sequence; });
+        return latest.sequence > sequence ? latest : jpeg_frame();
+    }
+
+    std::string description() const override
+    {
+        return "relay of " + url;
+    }
+
+    std::string report() const override
+    {
+        auto stats = client.stats(id);
+        return "upstream: " + url + (stats.connected ? " connected" : " disconnected")
+            + " frames: " + std::to_string(stats.frames)
+            + " reconnects: " + std::to_string(stats.reconnects) + "\n";
+    }
+
+private:
+    void received(const unsigned char *data, size_t size)
+    {
+        jpeg_frame frame;
+        frame.received = std::chrono::steady_clock::now();
+        gettimeofday(&frame.timestamp, nullptr);
+        frame.wall_clock = frame.timestamp;
+
+        // Only the client thread takes buffers from the pool.
+        auto buffer = pool.get();
+        buffer->assign((const char *)data, size);
+        frame.data = std::move(buffer);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            frame.sequence = latest.sequence + 1;
+            latest = std::move(frame);
+        }
+        cond.notify_all();
+    }
+
+    std::string url;
+    Capture::mjpeg_client client;
+    int id = -1;
+    std::thread thread;
+    std::atomic_bool active{ false };
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    jpeg_frame latest;
+    Capture::buffer_pool pool;
+};
+
+std::unique_ptr<frame_source> frame_source::create(const std::string &device, const capture_options &capture,
+    const encode_scheduler::queue &encoder)
+{
+    if (device.compare(0, 7, "http://") == 0)
+        return std::make_unique<relay_source>(device);
+
+    return std::make_unique<v4l2_source>(device, capture, encoder);
+}
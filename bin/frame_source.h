@@ -0,0 +1,82 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef MJPEG_OVER_HTTP_FRAME_SOURCE_H
+#define MJPEG_OVER_HTTP_FRAME_SOURCE_H
+
+#include "encoder.h"
+
+#include <Capture/socket.h>
+#include <Capture/v4l2.h>
+
+#include <sys/time.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+// Jpeg ready to be sent, shared by all clients.
+struct jpeg_frame
+{
+    std::shared_ptr<const std::string> data;
+    struct timeval timestamp = {};
+    // Wall clock time of the capture or the receipt, comparable with clocks of clients.
+    struct timeval wall_clock = {};
+    // Increments for every new frame of the source.
+    uint64_t sequence = 0;
+    // When the bytes were received, used to measure the hop latency of a relay.
+    std::chrono::steady_clock::time_point received;
+    // Mean luma of 8x8 blocks, set by sources that see raw pixels before they are encoded.
+    std::shared_ptr<const std::string> signature;
+
+    explicit operator bool() const { return bool(data); }
+    size_t size() const { return data ? data->size() : 0; }
+};
+
+// How a V4L2 device is read.
+struct capture_options
+{
+    // More buffers are smoother, fewer are fresher.
+    size_t buffers = 5;
+    // Only the newest ready frame is read, older ones are skipped.
+    bool latest = false;
+    // 0 keeps the rate of the device.
+    unsigned fps = 0;
+    Capture::v4l2::memory_type memory = Capture::v4l2::memory_mmap;
+    // APPn and COM segments of Motion-JPEG frames are dropped.
+    bool strip_metadata = false;
+    // Luma signatures of raw frames for change detection.
+    bool signatures = false;
+};
+
+/**
+ * Where frames come from: a local V4L2 device or an upstream Motion-JPEG stream.
+ * read() is called by the stream and snapshot threads.
+ */
+class frame_source
+{
+public:
+    virtual ~frame_source() = default;
+
+    // A V4L2 device path or an http:// url of an upstream stream to relay.
+    // Raw frames of a device are converted to jpeg by the encoder.
+    static std::unique_ptr<frame_source> create(const std::string &device,
+        const capture_options &capture = capture_options(),
+        const encode_scheduler::queue &encoder = encode_scheduler::queue());
+
+    virtual bool start(size_t width, size_t height) = 0;
+    virtual bool is_active() const = 0;
+    virtual bool is_relay() const { return false; }
+
+    // Returns a frame newer than the one with the sequence, or an empty frame on a timeout.
+    virtual jpeg_frame read(uint64_t sequence, std::chrono::milliseconds timeout = std::chrono::seconds(1)) = 0;
+
+    virtual std::string description() const = 0;
+    // Line for /stats.
+    virtual std::string report() const { return std::string(); }
+    // Formats, sizes and rates a device could capture, a line per mode.
+    virtual std::string modes() const { return std::string(); }
+};
+
+#endif
@@ -2,9 +2,14 @@
  * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
  */
 
+#include "frame_source.h"
+#include "variant.h"
+#include "adaptive.h"
+#include "motion.h"
+#include "multipart.h"
+
 #include <Capture/socket.h>
 #include <Capture/socket_thread.h>
-#include <Capture/v4l2.h>
 
 #include <getopt.h>
 #include <signal.h>
@@ -13,8 +18,11 @@
 #include <iostream>
 #include <chrono>
 #include <vector>
-
-#include <linux/videodev2.h>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <string_view>
+#include <string.h>
 
 static void help()
 {
@@ -24,7 +32,45 @@ static void help()
         " [-p | --port]..........: Port for this HTTP server\n" \
         " [-c | --credentials]...: Authorization: Basic \"username:password\"\n" \
         " [-d | --device]........: Camera device. By default \"/dev/video0'\"\n" \
+        "                          or http:// url of a Motion-JPEG stream to relay.\n" \
+        "                          Repeated as name=device for more cameras,\n" \
+        "                          served at /stream/name and /snapshot/name\n" \
         " [-s | --size]..........: Size of the image. By default 640x480\n" \
+        " [--tls-cert]...........: PEM certificate chain, enables HTTPS\n" \
+        " [--tls-key]............: PEM private key of the certificate\n" \
+        " [--client-budget]......: Max KiB queued per client. By default 4096\n" \
+        " [--total-budget].......: Max KiB queued for all clients. By default 65536\n" \
+        " [--budget-grace].......: Milliseconds over budget before a client is\n" \
+        "                          downgraded, x5 before disconnect. By default 2000\n" \
+        " [--handshake-timeout]..: Milliseconds to send a request. By default 10000\n" \
+        " [--write-timeout]......: Milliseconds without write progress before\n" \
+        "                          a client is dropped. By default 10000\n" \
+        " [--idle-timeout].......: Milliseconds without sent data before\n" \
+        "                          a client is dropped. By default 30000\n" \
+        " [--profile]............: Socket tuning: default, low-latency or throughput\n" \
+        " [--optimize-huffman]...: Optimize Huffman tables of ?quality= variants,\n" \
+        "                          saves bytes for more CPU\n" \
+        " [--adaptive]...........: Move /stream clients between quality tiers\n" \
+        "                          by their measured throughput\n" \
+        " [--motion-threshold]...: Percent of changed 8x8 blocks, frames below it\n" \
+        "                          are not streamed. Disabled by default\n" \
+        " [--keepalive]..........: Milliseconds between unchanged frames that\n" \
+        "                          are still streamed. By default 1000\n" \
+        " [--encoders]...........: Threads converting raw frames of all devices\n" \
+        "                          to jpeg. By default the number of cores\n" \
+        " [--encode-deadline]....: Milliseconds a raw frame may wait for\n" \
+        "                          an encoder before it is dropped. By default 0, never\n" \
+        " [--priority]...........: name=N, share of encoders of a device. By default 1\n" \
+        " [--buffers]............: Capture buffers of a device, more are smoother,\n" \
+        "                          fewer are fresher. By default 5\n" \
+        " [--latest].............: Read only the newest captured frame, skip older\n" \
+        " [--fps]................: Frames per second of devices. By default of the driver\n" \
+        " [--list-modes].........: Print modes of devices, the chosen ones and exit.\n" \
+        "                          A mode covers the size and the fps at the lowest cost,\n" \
+        "                          Motion-JPEG is preferred to encoding of raw frames\n" \
+        " [--memory].............: mmap, userptr or hugepages, capture buffers mapped\n" \
+        "                          from the driver or allocated here. By default mmap\n" \
+        " [--strip-metadata].....: Drop APPn and COM segments of camera jpeg frames\n" \
         " ---------------------------------------------------------------\n";
 }
 
@@ -34,7 +80,6 @@ static void help()
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 3 Jan 2000 00:00:00 GMT\r\n"
 
-#define BOUNDARY "mjpeg-over-http-boundary"
 #define HEADER_STREAM "HTTP/1.0 200 OK\r\n" \
     "Access-Control-Allow-Origin: *\r\n" \
     HEADER_DEFAULT \
@@ -48,6 +93,7 @@ static void help()
     "Content-Type: image/jpeg\r\n"
 
 #define HEADER_OK "HTTP/1.1 200 OK\r\n"
+#define HEADER_400 "HTTP/1.0 400 Bad Request\r\n"
 #define HEADER_404 "HTTP/1.0 404 Not Found\r\n"
 #define HEADER_401 "HTTP/1.0 401 Unauthorized\r\n" \
     "WWW-Authenticate: Basic realm=\"MJPEG-Over-HTTP\"\r\n"
@@ -75,9 +121,34 @@ static void install_signal_handler()
         exit(EXIT_FAILURE);
 }
 
-static bool parse_opts(int argc, char **argv,
-    std::string &hostname, int &port, std::string &credentials,
-    std::string &device, int &width, int &height)
+struct options
+{
+    std::string hostname = "0.0.0.0";
+    int port = 8080;
+    std::string credentials;
+    // Names and devices, /stream is of the first one.
+    std::vector<std::pair<std::string, std::string>> devices;
+    int width = 640;
+    int height = 480;
+    std::string tls_cert;
+    std::string tls_key;
+    Capture::send_budget budget{ 4 << 20, 64 << 20 };
+    Capture::socket_deadlines deadlines{ std::chrono::seconds(10), std::chrono::seconds(30) };
+    std::chrono::milliseconds handshake_timeout{ 10000 };
+    std::string profile_name = "default";
+    Capture::socket_profile profile;
+    bool optimize_huffman = false;
+    bool adaptive = false;
+    double motion_threshold = -1;
+    std::chrono::milliseconds keepalive{ 1000 };
+    size_t encoders = 0;
+    std::chrono::milliseconds encode_deadline{ 0 };
+    std::map<std::string, unsigned> priorities;
+    capture_options capture;
+    bool list_modes = false;
+};
+
+static bool parse_opts(int argc, char **argv, options &opts)
 {
     while (1) {
         int option_index = 0, c = 0;
@@ -94,6 +165,28 @@ static bool parse_opts(int argc, char **argv,
             {"device", required_argument, 0, 0},
             {"s", required_argument, 0, 0},
             {"size", required_argument, 0, 0},
+            {"tls-cert", required_argument, 0, 0},
+            {"tls-key", required_argument, 0, 0},
+            {"client-budget", required_argument, 0, 0},
+            {"total-budget", required_argument, 0, 0},
+            {"budget-grace", required_argument, 0, 0},
+            {"handshake-timeout", required_argument, 0, 0},
+            {"write-timeout", required_argument, 0, 0},
+            {"idle-timeout", required_argument, 0, 0},
+            {"profile", required_argument, 0, 0},
+            {"optimize-huffman", no_argument, 0, 0},
+            {"adaptive", no_argument, 0, 0},
+            {"motion-threshold", required_argument, 0, 0},
+            {"keepalive", required_argument, 0, 0},
+            {"encoders", required_argument, 0, 0},
+            {"encode-deadline", required_argument, 0, 0},
+            {"priority", required_argument, 0, 0},
+            {"buffers", required_argument, 0, 0},
+            {"latest", no_argument, 0, 0},
+            {"fps", required_argument, 0, 0},
+            {"list-modes", no_argument, 0, 0},
+            {"memory", required_argument, 0, 0},
+            {"strip-metadata", no_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -120,194 +213,608 @@ static bool parse_opts(int argc, char **argv,
         /* p, port */
         case 2:
         case 3:
-            port = atoi(optarg);
+            opts.port = atoi(optarg);
         break;
 
         /* Interface name */
         case 4:
         case 5:
-            hostname = optarg;
+            opts.hostname = optarg;
         break;
 
         /* c, credentials */
         case 6:
         case 7:
-            credentials = optarg;
+            opts.credentials = optarg;
         break;
 
         /* d, device */
         case 8:
-        case 9:
-            device = optarg;
+        case 9: {
+            std::string device = optarg;
+            // name=device, an url could have '=' in its query.
+            auto eq = device.find('=');
+            if (eq != std::string::npos && eq < device.find_first_of("/:"))
+                opts.devices.emplace_back(device.substr(0, eq), device.substr(eq + 1));
+            else
+                opts.devices.emplace_back(std::to_string(opts.devices.size()), device);
+        }
         break;
 
         /* s, size */
         case 10:
-        case 11:
+        case 11: {
             std::string size = optarg;
             auto pos = size.find('x');
             if (pos != std::string::npos) {
-                width = atoi(size.substr(0, pos).c_str());
-                height = atoi(size.substr(pos + 1).c_str());
+                opts.width = atoi(size.substr(0, pos).c_str());
+                opts.height = atoi(size.substr(pos + 1).c_str());
+            }
+        }
+        break;
+
+        /* tls-cert */
+        case 12:
+            opts.tls_cert = optarg;
+        break;
+
+        /* tls-key */
+        case 13:
+            opts.tls_key = optarg;
+        break;
+
+        /* client-budget */
+        case 14:
+            opts.budget.per_connection = size_t(atoi(optarg)) << 10;
+        break;
+
+        /* total-budget */
+        case 15:
+            opts.budget.global = size_t(atoi(optarg)) << 10;
+        break;
+
+        /* budget-grace */
+        case 16:
+            opts.budget.grace = std::chrono::milliseconds(atoi(optarg));
+            opts.budget.timeout = 5 * opts.budget.grace;
+        break;
+
+        /* handshake-timeout */
+        case 17:
+            opts.handshake_timeout = std::chrono::milliseconds(atoi(optarg));
+        break;
+
+        /* write-timeout */
+        case 18:
+            opts.deadlines.write = std::chrono::milliseconds(atoi(optarg));
+        break;
+
+        /* idle-timeout */
+        case 19:
+            opts.deadlines.idle = std::chrono::milliseconds(atoi(optarg));
+        break;
+
+        /* profile */
+        case 20:
+            opts.profile_name = optarg;
+            if (opts.profile_name == "low-latency") {
+                opts.profile = Capture::socket_profile::low_latency();
+            } else if (opts.profile_name == "throughput") {
+                opts.profile = Capture::socket_profile::throughput();
+            } else if (opts.profile_name != "default") {
+                help();
+                return false;
+            }
+        break;
+
+        /* optimize-huffman */
+        case 21:
+            opts.optimize_huffman = true;
+        break;
+
+        /* adaptive */
+        case 22:
+            opts.adaptive = true;
+        break;
+
+        /* motion-threshold */
+        case 23:
+            opts.motion_threshold = atof(optarg);
+            opts.capture.signatures = opts.motion_threshold >= 0;
+        break;
+
+        /* keepalive */
+        case 24:
+            opts.keepalive = std::chrono::milliseconds(atoi(optarg));
+        break;
+
+        /* encoders */
+        case 25:
+            opts.encoders = atoi(optarg);
+        break;
+
+        /* encode-deadline */
+        case 26:
+            opts.encode_deadline = std::chrono::milliseconds(atoi(optarg));
+        break;
+
+        /* priority */
+        case 27: {
+            std::string priority = optarg;
+            auto eq = priority.find('=');
+            if (eq == std::string::npos) {
+                help();
+                return false;
+            }
+            opts.priorities[priority.substr(0, eq)] = atoi(priority.substr(eq + 1).c_str());
+        }
+        break;
+
+        /* buffers */
+        case 28:
+            opts.capture.buffers = atoi(optarg);
+        break;
+
+        /* latest */
+        case 29:
+            opts.capture.latest = true;
+        break;
+
+        /* fps */
+        case 30:
+            opts.capture.fps = atoi(optarg);
+        break;
+
+        /* list-modes */
+        case 31:
+            opts.list_modes = true;
+        break;
+
+        /* memory */
+        case 32:
+            if (!strcmp(optarg, "mmap")) {
+                opts.capture.memory = Capture::v4l2::memory_mmap;
+            } else if (!strcmp(optarg, "userptr")) {
+                opts.capture.memory = Capture::v4l2::memory_userptr;
+            } else if (!strcmp(optarg, "hugepages")) {
+                opts.capture.memory = Capture::v4l2::memory_hugepages;
+            } else {
+                help();
+                return false;
             }
         break;
+
+        /* strip-metadata */
+        case 33:
+            opts.capture.strip_metadata = true;
+        break;
         }
     }
 
+    if (opts.devices.empty())
+        opts.devices.emplace_back("0", "/dev/video0");
+
     return true;
 }
 
-static void send(Capture::socket &socket, std::string header, const std::string &mess)
+static void send(Capture::socket &socket, const char *status, std::string_view mess, const char *type = "text/html")
 {
-    header += "Content-type: text/html\r\n";
-    header += "Content-length: ";
-    header += std::to_string(mess.size()) + "\r\n";
-    header += HEADER_DEFAULT;
-    header += "\r\n";
-    header += mess;
-
-    socket.write(header);
+    char header[1024];
+    char *p = header, *e = header + sizeof(header);
+    p = append(p, e, status);
+    p = append(p, e, "Content-type: ");
+    p = append(p, e, type);
+    p = append(p, e, "\r\nContent-length: ");
+    p = append(p, e, mess.size());
+    p = append(p, e, "\r\n" HEADER_DEFAULT "\r\n");
+
+    if (socket.write(header, p - header))
+        socket.write(mess.data(), mess.size());
 }
 
-static std::mutex frame_mutex;
-static Capture::v4l2_frame read_frame(Capture::v4l2 &v4l2)
+// Time from receipt of a frame until it is handed to client sockets.
+struct hop_latency
 {
-    std::lock_guard<std::mutex> lock(frame_mutex);
-    auto frame = v4l2.read_frame();
-    if (frame && frame.pixel_format() != V4L2_PIX_FMT_MJPEG)
-        frame = frame.convert(V4L2_PIX_FMT_MJPEG);
+    std::chrono::microseconds sum{ 0 };
+    std::chrono::microseconds max{ 0 };
+    size_t count = 0;
+
+    void add(std::chrono::steady_clock::duration d)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d);
+        sum += us;
+        max = std::max(max, us);
+        ++count;
+    }
+};
 
-    return frame;
-}
+/**
+ * Pipeline of a device: its source and a stream thread that reads frames and fans them out to clients.
+ * Snapshots of all cameras are served by one shared thread.
+ */
+class camera
+{
+public:
+    camera(const std::string &name, const std::string &device, const options &opts, encode_scheduler &encoder)
+        : name(name)
+        , source(frame_source::create(device, opts.capture, encoder.add_source(priority(name, opts), opts.encode_deadline)))
+        , opts(opts)
+        , snapshot_variants(opts.optimize_huffman)
+        , stream_variants(opts.optimize_huffman)
+    {
+        if (opts.motion_threshold >= 0)
+            detector.reset(new change_detector(opts.motion_threshold, opts.keepalive));
+    }
 
-int main(int argc, char **argv)
+    bool start()
+    {
+        if (!source->start(opts.width, opts.height))
+            return false;
+
+        stream_thread.set_deadlines(opts.deadlines);
+        stream_thread.start([this](auto &batch) { stream(batch); });
+        return true;
+    }
+
+    void push_stream(Capture::socket &&socket)
+    {
+        stream_thread.push(std::move(socket));
+    }
+
+    // Called by the snapshot thread for the clients of this camera.
+    void snapshot(std::vector<Capture::socket *> &clients);
+
+    std::string report() const
+    {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        return report_text;
+    }
+
+    const std::string name;
+    std::unique_ptr<frame_source> source;
+    std::atomic<size_t> frame_size{ 0 };
+
+private:
+    static unsigned priority(const std::string &name, const options &opts)
+    {
+        auto it = opts.priorities.find(name);
+        return it != opts.priorities.end() ? it->second : 1;
+    }
+
+    void stream(Capture::sockets &batch);
+    // Refreshes per client usage of the send budget, at most once per second.
+    void report_clients(const Capture::sockets &batch);
+
+    const options &opts;
+    Capture::socket_thread stream_thread;
+
+    uint64_t snapshot_sequence = 0;
+    uint64_t snapshot_last = 0;
+    variant_cache snapshot_variants;
+
+    uint64_t stream_sequence = 0;
+    uint64_t stream_last = 0;
+    part_writer parts;
+    variant_cache stream_variants;
+    // Latest frame sizes of adaptive tiers.
+    std::array<size_t, tiers.size()> tier_sizes = {};
+    std::unique_ptr<change_detector> detector;
+    hop_latency latency;
+
+    mutable std::mutex report_mutex;
+    std::string report_text;
+    std::chrono::steady_clock::time_point report_time;
+};
+
+void camera::snapshot(std::vector<Capture::socket *> &clients)
 {
-    install_signal_handler();
+    if (!source->is_active()) {
+        for (auto socket : clients)
+            socket->close();
+        return;
+    }
 
-    int port = 8080;
-    std::string credentials, hostname = "0.0.0.0", device = "/dev/video0";
-    int width = 640, height = 480;
+    auto frame = source->read(snapshot_last);
+    if (!frame)
+        return;
+
+    snapshot_last = frame.sequence;
+    ++snapshot_sequence;
+    for (auto socket : clients) {
+        auto &part = snapshot_variants.get(variant_of(*socket), frame);
+        if (!part.frame) {
+            socket->close();
+            continue;
+        }
 
-    if (!parse_opts(argc, argv, hostname, port, credentials, device, width, height))
-        return 1;
+        char header[1024];
+        size_t header_size = part_header(header, sizeof(header), HEADER_SNAPSHOT, part.frame, snapshot_sequence);
+        if (!socket->write(header, header_size)) {
+            socket->close();
+            continue;
+        }
 
-    Capture::v4l2 v4l2(device);
-    if (!v4l2.start(width, height, V4L2_PIX_FMT_MJPEG)) {
-        std::cerr << "Could not start capturing." << std::endl;
-        exit(EXIT_FAILURE);
+        if (!socket->write(part.frame.data->data(), part.frame.size())) {
+            socket->close();
+            continue;
+        }
     }
 
-    if (v4l2.pixel_format() != V4L2_PIX_FMT_MJPEG)
-        std::cout << "Motion-JPEG is not supported by the device, video frames will be converted to jpeg." << std::endl;
+    snapshot_variants.sweep();
+}
 
-    Capture::socket_listener s;
-    if (!s.listen(hostname.c_str(), port)) {
-        std::cerr << "Could not open connection." << std::endl;
-        exit(EXIT_FAILURE);
+void camera::stream(Capture::sockets &batch)
+{
+    if (!source->is_active()) {
+        batch.clear();
+        return;
     }
 
-    std::cout << "Host................: " << hostname << std::endl;
-    std::cout << "Port................: " << port << std::endl;
-    std::cout << "Authorization: Basic: " << (credentials.empty() ? "disabled" : credentials) << std::endl;
-    std::cout << "Device..............: " << device << std::endl;
-    std::cout << "Image size..........: " << v4l2.native_width() << "x" << v4l2.native_height() << std::endl;
-    std::cout << std::endl;
+    // Deadlines of clients are checked between reads, even if the source stalls.
+    auto now = std::chrono::steady_clock::now();
+    auto deadline = std::clamp(stream_thread.next_deadline(), now, now + std::chrono::seconds(1));
+    auto frame = source->read(stream_last, std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+    if (!frame)
+        return;
+
+    stream_last = frame.sequence;
+    ++stream_sequence;
+    frame_size = frame.size();
+    tier_sizes[0] = frame.size();
+    now = std::chrono::steady_clock::now();
+    // Unchanged frames are sent only to new clients.
+    bool streamed = !detector || detector->update(frame, now);
+    int motion = detector ? detector->motion() : -1;
+
+    for (auto &socket : batch) {
+        // Sent data frees the budget before the frame is admitted,
+        // also when the frame is suppressed or skipped by the pacer.
+        if (!socket.flush()) {
+            socket.close();
+            continue;
+        }
 
-    Capture::socket_thread snapshot_thread;
-    snapshot_thread.start([&](auto &batch) {
-        if (!v4l2.is_active()) {
-            batch.clear();
-            return;
+        if (!streamed && socket.stats().frames_sent)
+            continue;
+
+        auto context = static_cast<client_context *>(socket.context().get());
+        const auto &v = variant_of(socket);
+        // Skipped before the frame is transformed.
+        if (context && !context->pacer.ready(now)) {
+            stream_variants.keep(v);
+            continue;
         }
 
-        auto frame = read_frame(v4l2);
-        if (!frame)
-            return;
-
-        std::string header = HEADER_SNAPSHOT;
-        header += "Content-Length: ";
-        header += std::to_string(frame.size()) + "\r\n";
-        header += "X-Timestamp: ";
-        header += std::to_string(frame.timestamp().tv_sec) + "." + std::to_string(frame.timestamp().tv_usec) + "\r\n";
-        header += "\r\n";
-
-        for (auto &socket : batch) {
-            if (!socket.write(header)) {
-                socket.close();
-                continue;
-            }
+        // Clients of the same variant share its frame, it is transformed once.
+        auto &part = stream_variants.get(v, frame);
+        if (!part.frame)
+            continue;
 
-            if (!socket.write(frame.data(), frame.size())) {
-                socket.close();
-                continue;
-            }
+        if (context && context->adaptive) {
+            tier_sizes[context->controller.tier()] = part.frame.size();
+            context->controller.offered(part.frame.size());
+            context->controller.update(socket, tier_sizes, now);
         }
-    });
 
-    Capture::socket_thread stream_thread;
-    stream_thread.start([&](auto &batch) {
-        if (!v4l2.is_active()) {
-            batch.clear();
-            return;
+        if (!part.header)
+            part.header = parts.header(part.frame, stream_sequence, motion);
+
+        size_t size = part_writer::size(*part.header, part.frame);
+        // The frame size could be unknown when the client was accepted.
+        auto stats = socket.stats();
+        if (!stats.frames_sent && !stats.frames_skipped)
+            socket.tune(opts.profile, size);
+
+        if (!socket.admit(size, opts.budget, part_writer::segments))
+            continue;
+
+        if (context)
+            context->pacer.consume(size);
+        part_writer::queue(socket, part.header, part.frame);
+    }
+
+    // Variants of suppressed frames are kept for the next change.
+    if (streamed)
+        stream_variants.sweep();
+    latency.add(std::chrono::steady_clock::now() - frame.received);
+    report_clients(batch);
+}
+
+void camera::report_clients(const Capture::sockets &batch)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now - report_time < std::chrono::seconds(1))
+        return;
+
+    report_time = now;
+    std::string r = source->report();
+    if (source->is_relay() && latency.count) {
+        r += "hop latency avg: " + std::to_string(latency.sum.count() / latency.count)
+            + " us max: " + std::to_string(latency.max.count()) + " us\n";
+    }
+    latency = hop_latency();
+    if (detector) {
+        r += std::string("motion: ") + (detector->motion() ? "yes" : "no")
+            + " suppressed frames: " + std::to_string(detector->suppressed()) + "\n";
+    }
+
+    for (auto &socket : batch) {
+        if (!socket)
+            continue;
+
+        auto stats = socket.stats();
+        auto context = static_cast<const client_context *>(socket.context().get());
+        r += socket.peer() + " queued: " + std::to_string(stats.queued)
+            + " sent: " + std::to_string(stats.frames_sent)
+            + " skipped: " + std::to_string(stats.frames_skipped)
+            + (stats.downgraded ? " downgraded" : "")
+            + (context && context->adaptive ? " tier: " + std::to_string(context->controller.tier()) : "") + "\n";
+    }
+
+    std::lock_guard<std::mutex> lock(report_mutex);
+    report_text = std::move(r);
+}
+
+// Splits /stream/<name> into the service and the index of the camera, /stream is of the first camera.
+// Returns -1 if not found.
+static int route(std::string_view &path, const std::vector<std::unique_ptr<camera>> &cameras)
+{
+    for (std::string_view service : { "/stream", "/snapshot" }) {
+        if (path.substr(0, service.size()) != service)
+            continue;
+
+        auto rest = path.substr(service.size());
+        if (rest.empty())
+            return 0;
+        if (rest[0] != '/')
+            return -1;
+
+        path = service;
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            if (cameras[i]->name == rest.substr(1))
+                return int(i);
         }
+        return -1;
+    }
 
-        auto frame = read_frame(v4l2);
-        if (!frame)
-            return;
-
-        std::string header = "Content-Type: image/jpeg\r\n";
-        header += "Content-Length: ";
-        header += std::to_string(frame.size()) + "\r\n";
-        header += "X-Timestamp: ";
-        header += std::to_string(frame.timestamp().tv_sec) + "." + std::to_string(frame.timestamp().tv_usec) + "\r\n";
-        header += "\r\n";
-
-        for (auto &socket : batch) {
-            if (!socket.write(header)) {
-                socket.close();
-                continue;
-            }
+    return -1;
+}
 
-            if (!socket.write(frame.data(), frame.size())) {
-                socket.close();
-                continue;
-            }
+int main(int argc, char **argv)
+{
+    install_signal_handler();
+
+    options opts;
+    if (!parse_opts(argc, argv, opts))
+        return 1;
+
+    // Shared by devices that need conversion to jpeg.
+    encode_scheduler encoder(opts.encoders);
+    std::vector<std::unique_ptr<camera>> cameras;
+    for (auto &d : opts.devices) {
+        cameras.emplace_back(new camera(d.first, d.second, opts, encoder));
+        if (opts.list_modes) {
+            auto &source = cameras.back()->source;
+            source->start(opts.width, opts.height);
+            std::cout << d.first << ": " << source->description() << std::endl << source->modes();
+            continue;
+        }
+        if (!cameras.back()->start()) {
+            std::cerr << "Could not start capturing " << d.second << "." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (opts.list_modes)
+        return 0;
+
+    Capture::socket_listener s;
+    if (!s.listen(opts.hostname.c_str(), opts.port)) {
+        std::cerr << "Could not open connection." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    s.set_handshake_timeout(opts.handshake_timeout);
+    if (!opts.tls_cert.empty() && !s.use_tls(opts.tls_cert, opts.tls_key.empty() ? opts.tls_cert : opts.tls_key)) {
+        std::cerr << "Could not load TLS certificate." << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
-            if (!socket.write("\r\n--" BOUNDARY "\r\n")) {
-                socket.close();
-                continue;
+    std::cout << "Host................: " << opts.hostname << std::endl;
+    std::cout << "Port................: " << opts.port << std::endl;
+    std::cout << "TLS.................: " << (s.is_tls() ? "enabled" : "disabled") << std::endl;
+    std::cout << "Authorization: Basic: " << (opts.credentials.empty() ? "disabled" : opts.credentials) << std::endl;
+    for (auto &c : cameras)
+        std::cout << "Device..............: /stream/" << c->name << " " << c->source->description() << std::endl;
+    std::cout << "Socket profile......: " << opts.profile_name << std::endl;
+    std::cout << "Send budget.........: " << (opts.budget.per_connection >> 10) << " KiB per client, "
+        << (opts.budget.global >> 10) << " KiB total" << std::endl;
+    std::cout << std::endl;
+
+    Capture::socket_thread snapshot_thread;
+    snapshot_thread.set_deadlines(opts.deadlines);
+    snapshot_thread.start([&](auto &batch) {
+        std::vector<Capture::socket *> clients;
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            clients.clear();
+            for (auto &socket : batch) {
+                auto context = static_cast<const client_context *>(socket.context().get());
+                if (socket && (context ? context->camera : 0) == i)
+                    clients.push_back(&socket);
             }
+            if (!clients.empty())
+                cameras[i]->snapshot(clients);
         }
     });
 
     while (!stop) {
+        // Send buffers of new clients are sized by the latest frame.
+        size_t frame_size = 0;
+        for (auto &c : cameras)
+            frame_size = std::max<size_t>(frame_size, c->frame_size);
+        s.set_profile(opts.profile, frame_size);
         s.accept([&](auto socket) {
             Capture::http_request http(socket);
 
-            if (!credentials.empty() && credentials != http.basic_authorization()) {
+            if (!opts.credentials.empty() && opts.credentials != http.basic_authorization()) {
                 send(socket, HEADER_401, "Access denied");
                 return;
             }
-            if (http.uri() == "/") {
+
+            // Variant of the frames is requested in the query, e.g. /stream?width=320
+            std::string uri = http.uri();
+            std::string_view path = uri;
+            auto q = path.find('?');
+            variant v;
+            frame_pacer pacer;
+            if (q != std::string_view::npos) {
+                if (!parse_variant(path.substr(q + 1), v) || !parse_pacer(path.substr(q + 1), pacer)) {
+                    send(socket, HEADER_400, "Invalid parameters");
+                    return;
+                }
+                path = path.substr(0, q);
+            }
+
+            if (path == "/") {
                 send(socket, HEADER_OK, INFO);
                 return;
             }
-            if (http.uri() == "/stream") {
-                if (!socket.write(HEADER_STREAM))
-                    return;
+            if (path == "/stats") {
+                std::string report = "total queued: " + std::to_string(Capture::socket::total_queued()) + "\n";
+                for (auto &c : cameras)
+                    report += "\n/stream/" + c->name + " " + c->source->description() + "\n" + c->report();
+                send(socket, HEADER_OK, report, "text/plain");
+                return;
+            }
 
-                stream_thread.push(std::move(socket));
+            int index = route(path, cameras);
+            if (index < 0) {
+                send(socket, HEADER_404, "Service is not registered");
                 return;
             }
-            if (http.uri() == "/snapshot") {
-                snapshot_thread.push(std::move(socket));
+
+            // Clients that did not ask for a variant are adaptive.
+            bool adaptive = opts.adaptive && v.is_native() && path == "/stream";
+            if (!v.is_native() || adaptive || pacer.is_limited() || index) {
+                auto context = std::make_shared<client_context>();
+                context->requested = v;
+                context->adaptive = adaptive;
+                context->pacer = pacer;
+                context->camera = index;
+                socket.set_context(context);
+            }
+
+            if (path == "/stream") {
+                if (!socket.write(HEADER_STREAM))
+                    return;
+
+                cameras[index]->push_stream(std::move(socket));
                 return;
             }
 
-            send(socket, HEADER_404, "Service is not registered");
+            snapshot_thread.push(std::move(socket));
         });
     }
 
     std::cout <<"exiting..." << std::endl;
     return 0;
-}
\ No newline at end of file
+}
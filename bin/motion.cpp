@@ -0,0 +1,47 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "motion.h"
+
+#include <cstdlib>
+
+// A block changed if its mean luma moved more than sensor noise and DC quantization.
+static const int block_delta = 6;
+
+bool change_detector::changed(const jpeg_frame &frame)
+{
+    if (frame.signature)
+        current = *frame.signature;
+    else if (!transform.luma_signature(frame.data->data(), frame.size(), current))
+        current.clear();
+
+    if (current.empty() || current.size() != reference.size()) {
+        reference.swap(current);
+        return true;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < current.size(); ++i) {
+        if (std::abs(int((unsigned char)current[i]) - int((unsigned char)reference[i])) > block_delta)
+            ++count;
+    }
+
+    if (count * 100.0 <= threshold * current.size())
+        return false;
+
+    reference.swap(current);
+    return true;
+}
+
+bool change_detector::update(const jpeg_frame &frame, clock::time_point now)
+{
+    is_motion = changed(frame);
+    if (!is_motion && now - streamed < keepalive) {
+        ++suppressed_count;
+        return false;
+    }
+
+    streamed = now;
+    return true;
+}
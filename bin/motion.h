@@ -0,0 +1,47 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef MJPEG_OVER_HTTP_MOTION_H
+#define MJPEG_OVER_HTTP_MOTION_H
+
+#include "frame_source.h"
+
+#include <Capture/jpeg_transform.h>
+
+/**
+ * Compares mean luma of 8x8 blocks of a frame with the latest frame that was considered changed,
+ * so a slow drift is detected too. The signature of a jpeg is read from its DC coefficients
+ * unless the source provided one. Unchanged frames are still streamed at the keepalive interval.
+ */
+class change_detector
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // Percent of blocks that must change.
+    change_detector(double threshold, std::chrono::milliseconds keepalive)
+        : threshold(threshold)
+        , keepalive(keepalive)
+    {
+    }
+
+    // Returns true if the frame should be streamed: it changed or the keepalive is due.
+    bool update(const jpeg_frame &frame, clock::time_point now);
+    bool motion() const { return is_motion; }
+    size_t suppressed() const { return suppressed_count; }
+
+private:
+    bool changed(const jpeg_frame &frame);
+
+    double threshold = 0;
+    std::chrono::milliseconds keepalive;
+    clock::time_point streamed;
+    bool is_motion = true;
+    size_t suppressed_count = 0;
+    std::string reference;
+    std::string current;
+    Capture::jpeg_transform transform;
+};
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "multipart.h"
+
+#include <string.h>
+#include <algorithm>
+
+static const auto boundary = std::make_shared<const std::string>("\r\n--" BOUNDARY "\r\n");
+
+char *append(char *p, char *e, const char *s)
+{
+    size_t n = std::min(strlen(s), size_t(e - p));
+    return (char *)memcpy(p, s, n) + n;
+}
+
+// Microseconds as 6 digits after the point.
+static char *append_usec(char *p, char *e, long usec)
+{
+    if (e - p < 6)
+        return p;
+    for (int i = 5; i >= 0; --i, usec /= 10)
+        p[i] = char('0' + usec % 10);
+    return p + 6;
+}
+
+size_t part_header(char *b, size_t size, const char *prefix, const jpeg_frame &frame, uint64_t sequence, int motion)
+{
+    char *p = b, *e = b + size;
+    p = append(p, e, prefix);
+    p = append(p, e, "Content-Length: ");
+    p = append(p, e, frame.size());
+    p = append(p, e, "\r\nX-Timestamp: ");
+    p = append(p, e, frame.timestamp.tv_sec);
+    p = append(p, e, ".");
+    p = append(p, e, frame.timestamp.tv_usec);
+    p = append(p, e, "\r\nX-Capture-Time: ");
+    p = append(p, e, frame.wall_clock.tv_sec);
+    p = append(p, e, ".");
+    p = append_usec(p, e, frame.wall_clock.tv_usec);
+    p = append(p, e, "\r\nX-Sequence: ");
+    p = append(p, e, sequence);
+    if (motion >= 0) {
+        p = append(p, e, "\r\nX-Motion: ");
+        p = append(p, e, motion);
+    }
+    p = append(p, e, "\r\n\r\n");
+    return p - b;
+}
+
+std::shared_ptr<const std::string> part_writer::header(const jpeg_frame &frame, uint64_t sequence, int motion)
+{
+    // Buffers are reused once all clients sent them.
+    auto header = pool.get();
+    header->resize(1024);
+    header->resize(part_header(&(*header)[0], header->size(), "Content-Type: image/jpeg\r\n", frame, sequence, motion));
+    return header;
+}
+
+size_t part_writer::size(const std::string &header, const jpeg_frame &frame)
+{
+    return header.size() + frame.size() + boundary->size();
+}
+
+bool part_writer::queue(Capture::socket &socket, const std::shared_ptr<const std::string> &header, const jpeg_frame &frame)
+{
+    // The frame is referenced by every client queue, not copied.
+    const auto &data = frame.data;
+    if (socket.queue({ header, header->data() }, header->size())
+        && socket.queue({ data, data->data() }, data->size())
+        && socket.queue({ boundary, boundary->data() }, boundary->size())
+        && socket.flush())
+        return true;
+
+    socket.close();
+    return false;
+}
+
+size_t part_writer::pooled() const
+{
+    return pool.size();
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef MJPEG_OVER_HTTP_MULTIPART_H
+#define MJPEG_OVER_HTTP_MULTIPART_H
+
+#include "frame_source.h"
+
+#include <Capture/socket.h>
+
+#include <charconv>
+#include <memory>
+#include <string>
+
+#define BOUNDARY "mjpeg-over-http-boundary"
+
+// Appends to a fixed buffer, numbers are written by std::to_chars: no allocations.
+char *append(char *p, char *e, const char *s);
+
+template <class T>
+inline char *append(char *p, char *e, T v)
+{
+    return std::to_chars(p, e, v).ptr;
+}
+
+// Header of a jpeg part: the template with numeric fields filled in.
+// Motion is -1 if not detected.
+size_t part_header(char *b, size_t size, const char *prefix, const jpeg_frame &frame, uint64_t sequence, int motion = -1);
+
+/**
+ * Parts of a Motion-JPEG stream: a header, the frame and the boundary are queued to sockets by reference.
+ * Headers are written to pooled buffers, so a steady stream is sent without heap allocations.
+ */
+class part_writer
+{
+public:
+    // Queue entries of a part, for socket::admit().
+    static const size_t segments = 3;
+
+    std::shared_ptr<const std::string> header(const jpeg_frame &frame, uint64_t sequence, int motion = -1);
+    static size_t size(const std::string &header, const jpeg_frame &frame);
+    // A part is queued whole or the socket is closed, the stream is never cut.
+    static bool queue(Capture::socket &socket, const std::shared_ptr<const std::string> &header, const jpeg_frame &frame);
+    size_t pooled() const;
+
+private:
+    Capture::buffer_pool pool;
+};
+
+#endif
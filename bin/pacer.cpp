@@ -0,0 +1,43 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "pacer.h"
+#include "variant.h"
+
+#include <algorithm>
+
+bool frame_pacer::ready(clock::time_point now)
+{
+    double seconds = refilled == clock::time_point() ? 0 : std::chrono::duration<double>(now - refilled).count();
+    refilled = now;
+
+    // At most one frame or a quarter of a second of bytes is saved up, no bursts after idle periods.
+    frames = std::min(frames + seconds * fps, 1.0);
+    double rate = kbps * 125.0;
+    bytes = std::min(bytes + seconds * rate, rate / 4);
+
+    // Half a token is enough, frames of the source are not evenly spaced.
+    // The debt is repaid before the next one, the average rate does not exceed the limit.
+    return (!fps || frames >= 0.5) && (!kbps || bytes >= 0);
+}
+
+void frame_pacer::consume(size_t size)
+{
+    if (fps)
+        frames -= 1;
+    // Could go below zero, a frame is never split.
+    if (kbps)
+        bytes -= size;
+}
+
+bool parse_pacer(std::string_view query, frame_pacer &pacer)
+{
+    return for_each_param(query, [&](auto name, auto value) {
+        if (name == "fps")
+            return parse_number(value, pacer.fps) && pacer.fps;
+        if (name == "kbps")
+            return parse_number(value, pacer.kbps) && pacer.kbps;
+        return true;
+    });
+}
@@ -0,0 +1,39 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef MJPEG_OVER_HTTP_PACER_H
+#define MJPEG_OVER_HTTP_PACER_H
+
+#include <chrono>
+#include <string_view>
+
+/**
+ * Limits frames sent to a client by two token buckets, e.g. /stream?fps=5&kbps=800.
+ * Frames are skipped while a bucket is empty, nothing is kept per frame.
+ */
+class frame_pacer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    // 0 is unlimited.
+    unsigned fps = 0;
+    unsigned kbps = 0;
+
+    bool is_limited() const { return fps || kbps; }
+    // Refills the buckets, returns true if a frame could be sent now.
+    bool ready(clock::time_point now);
+    // A frame of the bytes is sent.
+    void consume(size_t bytes);
+
+private:
+    double frames = 1;
+    double bytes = 0;
+    clock::time_point refilled;
+};
+
+// Unknown parameters are ignored, returns false on invalid values.
+bool parse_pacer(std::string_view query, frame_pacer &pacer);
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "variant.h"
+
+bool parse_variant(std::string_view query, variant &v)
+{
+    return for_each_param(query, [&](auto name, auto value) {
+        if (name == "width")
+            return parse_number(value, v.width) && v.width;
+        if (name == "quality")
+            return parse_number(value, v.quality) && v.quality >= 1 && v.quality <= 100;
+        if (name == "crop") {
+            // x,y,w,h
+            for (size_t i = 0; i < v.crop.size(); ++i) {
+                auto comma = value.find(',');
+                if ((comma == std::string_view::npos) != (i + 1 == v.crop.size()))
+                    return false;
+                if (!parse_number(value.substr(0, comma), v.crop[i]))
+                    return false;
+                value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+            }
+            return v.crop[2] && v.crop[3];
+        }
+        if (name == "chroma") {
+            v.low_chroma = true;
+            return value == "low";
+        }
+        return true;
+    });
+}
+
+variant_cache::part &variant_cache::get(const variant &v, const jpeg_frame &frame)
+{
+    auto &e = entries[v];
+    e.used = true;
+    if (e.sequence == frame.sequence)
+        return e.p;
+
+    e.sequence = frame.sequence;
+    e.p.header.reset();
+    e.p.frame = frame;
+    if (v.is_native())
+        return e.p;
+
+    // Buffers are reused once clients sent them.
+    auto data = e.pool.get();
+    const void *input = frame.data->data();
+    size_t size = frame.size();
+    bool ok = true;
+    if (v.crop[2]) {
+        // Lossless, coefficient blocks of the region are copied.
+        bool only = !v.width && !v.quality && !v.low_chroma;
+        auto &out = only ? *data : region;
+        ok = transform.crop(input, size, v.crop[0], v.crop[1], v.crop[2], v.crop[3], out);
+        input = out.data();
+        size = out.size();
+    }
+
+    if (ok && (v.width || v.eighths < 8)) {
+        // Encoded from pixels anyway, the quality is applied there.
+        int quality = v.quality ? v.quality : 85;
+        ok = v.width ? transform.scale(input, size, v.width, *data, quality)
+            : transform.scale_by(input, size, v.eighths, *data, quality);
+        if (ok && data->empty() && v.crop[2])
+            data->assign((const char *)input, size);
+    } else if (ok && (v.quality || v.low_chroma)) {
+        // Coarser quantization of the coefficients, without decoding to pixels.
+        ok = transform.requantize(input, size, v.quality ? v.quality : 100, *data, v.low_chroma, optimize_huffman);
+        if (ok && data->empty() && v.crop[2])
+            data->assign((const char *)input, size);
+    }
+
+    if (!ok)
+        e.p.frame = jpeg_frame();
+    else if (!data->empty())
+        e.p.frame.data = std::move(data);
+
+    return e.p;
+}
+
+void variant_cache::keep(const variant &v)
+{
+    auto it = entries.find(v);
+    if (it != entries.end())
+        it->second.used = true;
+}
+
+void variant_cache::sweep()
+{
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (!it->second.used) {
+            it = entries.erase(it);
+            continue;
+        }
+
+        it->second.used = false;
+        ++it;
+    }
+}
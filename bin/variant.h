@@ -0,0 +1,111 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef MJPEG_OVER_HTTP_VARIANT_H
+#define MJPEG_OVER_HTTP_VARIANT_H
+
+#include "frame_source.h"
+
+#include <Capture/jpeg_transform.h>
+
+#include <array>
+#include <charconv>
+#include <map>
+#include <tuple>
+#include <string_view>
+
+template <class T>
+bool parse_number(std::string_view s, T &v)
+{
+    auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+    return r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+
+// Calls f(name, value) for each parameter of the query, stops when it returns false.
+template <class F>
+bool for_each_param(std::string_view query, F f)
+{
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        auto param = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+
+        auto eq = param.find('=');
+        auto value = eq == std::string_view::npos ? std::string_view() : param.substr(eq + 1);
+        if (!f(param.substr(0, eq), value))
+            return false;
+    }
+
+    return true;
+}
+
+// What a client requested in the query, e.g. /stream?width=320, /stream?quality=30&chroma=low
+// or /stream?crop=x,y,w,h. A region is cropped first.
+struct variant
+{
+    size_t width = 0;
+    // Scale by n/8 if not 8, used when the width is not known.
+    unsigned eighths = 8;
+    int quality = 0;
+    // Only the lowest frequencies of chroma are kept.
+    bool low_chroma = false;
+    // x, y, width, height
+    std::array<size_t, 4> crop = {};
+
+    bool is_native() const { return !width && eighths == 8 && !quality && !low_chroma && !crop[2]; }
+    bool operator<(const variant &other) const
+    {
+        return std::tie(width, eighths, quality, low_chroma, crop)
+            < std::tie(other.width, other.eighths, other.quality, other.low_chroma, other.crop);
+    }
+};
+
+// Unknown parameters are ignored, returns false on invalid values.
+bool parse_variant(std::string_view query, variant &v);
+
+/**
+ * Frames of the variants requested by clients of one thread.
+ * A variant is transformed once per source frame and shared by all its clients,
+ * it is kept only while some client requests it.
+ */
+class variant_cache
+{
+public:
+    struct part
+    {
+        // Empty if the frame could not be transformed.
+        jpeg_frame frame;
+        // Part header, built by the caller once per frame.
+        std::shared_ptr<const std::string> header;
+    };
+
+    variant_cache(bool optimize_huffman = false)
+        : optimize_huffman(optimize_huffman)
+    {
+    }
+
+    part &get(const variant &v, const jpeg_frame &frame);
+    // Keeps the variant over the sweep when its clients skip a frame.
+    void keep(const variant &v);
+    // Drops variants that were not requested since the previous sweep.
+    void sweep();
+    size_t size() const { return entries.size(); }
+
+private:
+    struct entry
+    {
+        part p;
+        uint64_t sequence = 0;
+        bool used = false;
+        Capture::buffer_pool pool;
+    };
+
+    bool optimize_huffman = false;
+    std::map<variant, entry> entries;
+    // Cropped region before it is scaled or requantized.
+    std::string region;
+    Capture::jpeg_transform transform;
+};
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+/**
+ * Captures several cameras on one thread by an epoll loop and prints frames per second of each camera.
+ *
+ * $ ./cameras /dev/video0 /dev/video2 ...
+ */
+
+#include <Capture/v4l2.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+static bool stop = false;
+
+static void signal_handler(int sig)
+{
+    stop = true;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> devices(argv + 1, argv + argc);
+    if (devices.empty())
+        devices.push_back("/dev/video0");
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<Capture::v4l2>> cameras;
+    std::vector<size_t> frames(devices.size());
+    for (size_t i = 0; i < devices.size(); ++i) {
+        cameras.emplace_back(new Capture::v4l2(devices[i]));
+        auto &cap = *cameras.back();
+        if (!cap.start(640, 480)) {
+            std::cerr << "Could not start capturing " << devices[i] << "." << std::endl;
+            return 1;
+        }
+
+        // Data of the frame could be processed or copied here.
+        cap.set_callback([&frames, i](const Capture::v4l2_frame &frame) { ++frames[i]; });
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cap.fd(), &ev) < 0) {
+            perror("epoll_ctl");
+            return 1;
+        }
+    }
+
+    signal(SIGINT, signal_handler);
+
+    auto time = std::chrono::steady_clock::now();
+    struct epoll_event events[16];
+    while (!stop) {
+        int n = epoll_wait(epoll_fd, events, 16, 1000);
+        for (int i = 0; i < n; ++i) {
+            auto &cap = *cameras[events[i].data.u64];
+            if (!cap.on_readable()) {
+                std::cerr << cap.device() << " is lost." << std::endl;
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cap.fd(), nullptr);
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - time < std::chrono::seconds(1))
+            continue;
+
+        time = now;
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            std::cout << devices[i] << " fps: " << frames[i] << std::endl;
+            frames[i] = 0;
+        }
+    }
+
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+/**
+ * Pulls the same Motion-JPEG stream several times on one thread and prints stats of each stream.
+ *
+ * $ ./client [url-to-stream-over-http] [count]
+ */
+
+#include <Capture/mjpeg_client.h>
+
+#include <signal.h>
+
+#include <iostream>
+#include <vector>
+
+static Capture::mjpeg_client *client = nullptr;
+
+static void signal_handler(int sig)
+{
+    if (client)
+        client->stop();
+}
+
+int main(int argc, char **argv)
+{
+    std::string url = argc > 1 ? argv[1] : "http://127.0.0.1:8080/stream";
+    int count = argc > 2 ? strtol(argv[2], NULL, 0) : 1;
+
+    Capture::mjpeg_client c([](int id, const unsigned char *data, size_t size) {
+        // Data is valid only within the callback.
+    });
+
+    std::vector<int> ids;
+    for (int i = 0; i < count; ++i) {
+        int id = c.add(url);
+        if (id < 0) {
+            std::cerr << "Invalid url: " << url << std::endl;
+            return 1;
+        }
+        ids.push_back(id);
+    }
+
+    client = &c;
+    signal(SIGINT, signal_handler);
+
+    auto time = std::chrono::steady_clock::now();
+    while (c.run_once()) {
+        auto now = std::chrono::steady_clock::now();
+        if (now - time < std::chrono::seconds(1))
+            continue;
+
+        time = now;
+        for (int id : ids) {
+            auto stats = c.stats(id);
+            std::cout << "#" << id << (stats.connected ? " connected" : " disconnected")
+                << " frames: " << stats.frames << " bytes: " << stats.bytes
+                << " reconnects: " << stats.reconnects << std::endl;
+        }
+    }
+
+    return 0;
+}
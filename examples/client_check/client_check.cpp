@@ -0,0 +1,151 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+/**
+ * Checks Capture::mjpeg_client against a local server that writes parts in odd sized pieces,
+ * so headers, frames and boundaries are split between reads, and drops every connection
+ * in the middle of a frame, so the client reconnects. Exits with 1 if a frame is lost or damaged.
+ *
+ * $ ./client_check [port] [connections] [frames per connection]
+ */
+
+#include <Capture/mjpeg_client.h>
+#include <Capture/socket.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Frame of the index: SOI, the index and bytes derived from it, EOI.
+static std::string frame(size_t index)
+{
+    std::string r = "\xff\xd8#" + std::to_string(index) + "#";
+    size_t size = 1000 + index * 37 % 3000;
+    for (size_t i = 0; i < size; ++i)
+        r += char('a' + (index + i) % 26);
+    r += "\xff\xd9";
+    return r;
+}
+
+static std::string part(size_t index)
+{
+    auto f = frame(index);
+    return "Content-Type: image/jpeg\r\nContent-Length: " + std::to_string(f.size()) + "\r\n\r\n" + f + "\r\n--boundary\r\n";
+}
+
+static std::atomic<bool> done{ false };
+
+// Serves the connections one by one, each ends inside the frame that follows the complete ones.
+static void serve(Capture::socket_listener &s, size_t connections, size_t frames)
+{
+    static const size_t pieces[] = { 1, 2, 3, 5, 7, 11, 13, 17, 97, 509 };
+    size_t piece = 0;
+    for (size_t c = 0; c < connections && !done;) {
+        s.accept([&](auto socket) {
+            if (done)
+                return;
+
+            std::string data = "HTTP/1.0 200 OK\r\n"
+                "Content-Type: multipart/x-mixed-replace;boundary=boundary\r\n\r\n--boundary\r\n";
+            for (size_t i = 0; i < frames; ++i)
+                data += part(c * (frames + 1) + i);
+            auto cut = part(c * (frames + 1) + frames);
+            data += cut.substr(0, cut.size() / 2);
+
+            for (size_t b = 0; b < data.size(); ) {
+                size_t n = std::min(pieces[piece++ % (sizeof(pieces) / sizeof(pieces[0]))], data.size() - b);
+                if (!socket.write(data.data() + b, n))
+                    break;
+                b += n;
+                usleep(200);
+            }
+            ++c;
+        });
+    }
+}
+
+// Wakes the server up if it waits for a connection the client will not open.
+static void wake(int port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    static const char request[] = "GET / HTTP/1.0\r\n\r\n";
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && write(fd, request, sizeof(request) - 1) < 0)
+        perror("wake");
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    int port = argc > 1 ? strtol(argv[1], NULL, 0) : 8091;
+    size_t connections = argc > 2 ? strtol(argv[2], NULL, 0) : 3;
+    size_t frames = argc > 3 ? strtol(argv[3], NULL, 0) : 20;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // stop() before run() is not lost.
+    {
+        Capture::mjpeg_client c([](int, const unsigned char *, size_t) {});
+        c.stop();
+        c.run();
+    }
+
+    Capture::socket_listener s;
+    Capture::socket_profile profile;
+    profile.no_delay = true;
+    s.set_profile(profile, 0);
+    if (!s.listen("127.0.0.1", port)) {
+        fprintf(stderr, "Could not listen on 127.0.0.1:%d\n", port);
+        return 1;
+    }
+
+    std::thread server(serve, std::ref(s), connections, frames);
+
+    size_t received = 0, damaged = 0;
+    size_t expected = 0;
+    Capture::mjpeg_client *client = nullptr;
+    Capture::mjpeg_client c([&](int, const unsigned char *data, size_t size) {
+        // Frames of a dropped connection are complete, its last one is never reported.
+        if (expected % (frames + 1) == frames)
+            ++expected;
+        auto f = frame(expected++);
+        if (f.size() != size || f.compare(0, f.size(), (const char *)data, size))
+            ++damaged;
+        if (++received == connections * frames)
+            client->stop();
+    });
+    client = &c;
+    c.set_timeout(std::chrono::milliseconds(5000), std::chrono::milliseconds(100));
+    int id = c.add("http://127.0.0.1:" + std::to_string(port) + "/stream");
+
+    std::thread watchdog([&] {
+        for (int i = 0; i < 300 && received < connections * frames; ++i)
+            usleep(100000);
+        c.stop();
+    });
+
+    c.run();
+    watchdog.join();
+    auto stats = c.stats(id);
+    c.remove(id);
+    done = true;
+    wake(port);
+    server.join();
+
+    printf("Frames: %zu of %zu, damaged: %zu, reconnects: %zu\n", received, connections * frames, damaged, stats.reconnects);
+    return received == connections * frames && !damaged && stats.reconnects >= connections - 1 ? 0 : 1;
+}
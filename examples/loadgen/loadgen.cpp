@@ -0,0 +1,166 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+/**
+ * Load generator for mjpeg-over-http: opens Motion-JPEG streams and prints what clients get,
+ * frames per second and age of a frame by its X-Capture-Time, a wall clock time,
+ * when its header is received. The clocks of both hosts should be synchronized.
+ * Slow clients read at a limited rate, so the effect of --profile on queued frames is seen.
+ *
+ * $ ./loadgen [host] [port] [path] [clients] [slow clients] [slow KiB/s] [seconds]
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct result
+{
+    size_t frames = 0;
+    // Milliseconds.
+    std::vector<double> ages;
+};
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *aip = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &aip);
+    if (err != 0) {
+        fprintf(stderr, "%s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (auto ai = aip; ai && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, 0);
+        if (fd < 0)
+            continue;
+
+        // Small window, the server should see a slow reader as one.
+        int size = 64 * 1024;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(aip);
+    return fd;
+}
+
+static double now_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+// Reads the stream for the duration, at most rate bytes per second if it is not zero.
+static void run(const char *host, const char *port, const std::string &path, size_t rate,
+    std::chrono::seconds duration, result &r)
+{
+    int fd = connect_to(host, port);
+    if (fd < 0) {
+        perror("connect");
+        return;
+    }
+
+    std::string request = "GET " + path + " HTTP/1.0\r\n\r\n";
+    if (write(fd, request.data(), request.size()) < 0) {
+        perror("write");
+        close(fd);
+        return;
+    }
+
+    static const std::string tag = "X-Capture-Time: ";
+    std::string buf;
+    char data[16 * 1024];
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + duration;
+    while (std::chrono::steady_clock::now() < end) {
+        int n = read(fd, data, sizeof(data));
+        if (n <= 0)
+            break;
+
+        buf.append(data, n);
+        size_t b = 0;
+        while ((b = buf.find(tag, b)) != std::string::npos) {
+            size_t e = buf.find("\r\n", b);
+            if (e == std::string::npos)
+                break;
+
+            double captured = strtod(buf.c_str() + b + tag.size(), nullptr) * 1e3;
+            r.ages.push_back(now_ms() - captured);
+            ++r.frames;
+            b = e;
+        }
+
+        // Keeps an incomplete header or a tail that could hold the start of one.
+        if (b == std::string::npos)
+            b = buf.size() > tag.size() ? buf.size() - tag.size() : 0;
+        buf.erase(0, b);
+
+        total += n;
+        if (rate)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(total * 1000000 / rate));
+    }
+
+    close(fd);
+}
+
+static void print(const char *name, size_t clients, const std::vector<result> &results, size_t from, double seconds)
+{
+    if (!clients)
+        return;
+
+    size_t frames = 0;
+    std::vector<double> ages;
+    for (size_t i = from; i < from + clients; ++i) {
+        frames += results[i].frames;
+        ages.insert(ages.end(), results[i].ages.begin(), results[i].ages.end());
+    }
+
+    std::sort(ages.begin(), ages.end());
+    auto at = [&](double q) { return ages.empty() ? 0 : ages[size_t(q * (ages.size() - 1))]; };
+    printf("%s clients: %zu fps per client: %.1f frame age ms p50: %.1f p95: %.1f max: %.1f\n",
+        name, clients, frames / seconds / clients, at(0.5), at(0.95), at(1));
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    const char *port = argc > 2 ? argv[2] : "8080";
+    std::string path = argc > 3 ? argv[3] : "/stream";
+    size_t clients = argc > 4 ? strtol(argv[4], NULL, 0) : 4;
+    size_t slow = argc > 5 ? strtol(argv[5], NULL, 0) : 4;
+    size_t rate = (argc > 6 ? strtol(argv[6], NULL, 0) : 512) * 1024;
+    std::chrono::seconds duration(argc > 7 ? strtol(argv[7], NULL, 0) : 10);
+
+    std::vector<result> results(clients + slow);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < results.size(); ++i)
+        threads.emplace_back(run, host, port, path, i < clients ? 0 : rate, duration, std::ref(results[i]));
+    for (auto &t : threads)
+        t.join();
+
+    print("fast", clients, results, 0, duration.count());
+    print("slow", slow, results, clients, duration.count());
+    return 0;
+}
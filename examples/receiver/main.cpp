@@ -9,6 +9,7 @@
  */
 
 #include <Capture/mjpeg_stream.h>
+#include <Capture/mjpeg_decoder.h>
 #include <private/qdeclarativevideooutput_p.h>
 
 #include <QtQml/QQmlContext>
@@ -46,13 +47,26 @@ int main(int argc, char *argv[])
             qWarning() << "ERROR:" << reply->errorString().toLatin1().constData();
     });
 
+    // Frames are decoded on worker threads and presented on the GUI thread.
+    Capture::mjpeg_decoder decoder([&](std::shared_ptr<const Capture::mjpeg_image> image) {
+        auto &plane = image->planes[0];
+        // The image keeps the decoded buffer until Qt releases the frame.
+        QImage img(plane.data, image->width, image->height, plane.stride, QImage::Format_RGB32,
+            [](void *p) { delete static_cast<std::shared_ptr<const Capture::mjpeg_image> *>(p); },
+            new std::shared_ptr<const Capture::mjpeg_image>(image));
+
+        QMetaObject::invokeMethod(videoOutput, [videoOutput, img] {
+            QVideoFrame frame(img);
+            if (!videoOutput->videoSurface()->isActive()) {
+                QVideoSurfaceFormat format(frame.size(), frame.pixelFormat());
+                videoOutput->videoSurface()->start(format);
+            }
+            videoOutput->videoSurface()->present(frame);
+        }, Qt::QueuedConnection);
+    }, Capture::mjpeg_decoder::bgrx);
+
     Capture::mjpeg_stream stream([&](const unsigned char *data, size_t size) {
-        QVideoFrame frame = QImage::fromData(data, size, "JPG");
-        if (!videoOutput->videoSurface()->isActive()) {
-            QVideoSurfaceFormat format(frame.size(), frame.pixelFormat());
-            videoOutput->videoSurface()->start(format);
-        }
-        videoOutput->videoSurface()->present(frame);
+        decoder.decode(data, size);
     });
 
     QObject::connect(reply, &QIODevice::readyRead, [&]{
@@ -63,6 +77,8 @@ int main(int argc, char *argv[])
     viewer.setMinimumSize(QSize(300, 360));
     viewer.resize(800, 600);
     viewer.show();
+    // Large frames are scaled down while decoding.
+    decoder.set_size(viewer.width(), viewer.height());
 
     return app.exec();
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 TEMPLATE = app
 TARGET = receiver
 CONFIG += link_pkgconfig
-PKGCONFIG += Capture_mjpeg_stream
+PKGCONFIG += Capture_mjpeg_stream Capture_mjpeg_decoder
 QT += widgets network quick multimedia qtmultimediaquicktools-private
 # Input
 SOURCES += main.cpp
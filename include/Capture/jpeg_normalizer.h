@@ -0,0 +1,56 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef CAPTURE_JPEG_NORMALIZER_H
+#define CAPTURE_JPEG_NORMALIZER_H
+
+#include <string>
+
+namespace Capture {
+
+struct jpeg_normalizer_stats
+{
+    size_t frames = 0;
+    // No EOI, or a segment that ends after the data.
+    size_t truncated = 0;
+    // No SOI, no scan or a broken marker.
+    size_t invalid = 0;
+    // Frames without Huffman tables, e.g. AVI1 of many UVC cameras.
+    size_t huffman_inserted = 0;
+    // After EOI, e.g. padding up to bytesused.
+    size_t trimmed_bytes = 0;
+    // Of APPn and COM segments.
+    size_t stripped_bytes = 0;
+};
+
+class jpeg_normalizer_private;
+/**
+ * Cleans Motion-JPEG frames of cameras that some decoders choke on.
+ * Walks the markers of headers and scans entropy coded data only for 0xFF, nothing is decoded,
+ * so it costs about as much as a copy of the frame. A frame that is cut short but still ends
+ * with EOI is not detected, that needs decoding.
+ */
+class jpeg_normalizer
+{
+public:
+    jpeg_normalizer();
+    ~jpeg_normalizer();
+
+    // APPn and COM segments are dropped, except JFIF APP0 and Adobe APP14 that tell the colour space.
+    void set_strip_metadata(bool strip);
+    // Copies the frame up to EOI to the output and inserts the standard Huffman tables if it has none.
+    // Returns false and an empty output if the frame is truncated or not a jpeg.
+    bool normalize(const void *data, size_t size, std::string &output);
+    jpeg_normalizer_stats stats() const;
+
+private:
+    jpeg_normalizer(const jpeg_normalizer &other) = delete;
+    jpeg_normalizer &operator=(const jpeg_normalizer &other) = delete;
+
+    jpeg_normalizer_private *m = nullptr;
+};
+
+} // Capture
+
+#endif
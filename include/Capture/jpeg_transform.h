@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef CAPTURE_JPEG_TRANSFORM_H
+#define CAPTURE_JPEG_TRANSFORM_H
+
+#include <string>
+
+namespace Capture {
+
+class jpeg_transform_private;
+/**
+ * Produces smaller jpeg images from a jpeg, or a cheap signature of it.
+ * libjpeg state and buffers are reused between calls, output strings keep their capacity.
+ * Not thread safe, one instance per thread.
+ */
+class jpeg_transform
+{
+public:
+    jpeg_transform();
+    ~jpeg_transform();
+
+    // Decodes with DCT scaling by n/8 to the smallest size not narrower than the width and encodes it.
+    // Output is empty if the image is not wider than the width.
+    bool scale(const void *data, size_t size, size_t width, std::string &output, int quality = 85);
+    // Scales by eighths/8, output is empty for 8.
+    bool scale_by(const void *data, size_t size, unsigned eighths, std::string &output, int quality = 85);
+    // Requantizes DCT coefficients to the tables of the quality without decoding to pixels.
+    // Optimized Huffman tables save bytes for a second pass over the coefficients.
+    // Output is empty if the image is already as coarse.
+    bool requantize(const void *data, size_t size, int quality, std::string &output,
+        bool drop_chroma = false, bool optimize_huffman = false);
+    // Copies coefficient blocks of the region, like jpegtran -crop, no IDCT/DCT and no loss.
+    // The offset is aligned down to the MCU grid, the region is clipped by the image.
+    bool crop(const void *data, size_t size, size_t x, size_t y, size_t width, size_t height, std::string &output);
+    // Mean luma of every 8x8 block, a byte per block, from the DC coefficients:
+    // AC coefficients are skipped by the entropy decoder, chroma is not transformed.
+    bool luma_signature(const void *data, size_t size, std::string &output);
+
+private:
+    jpeg_transform(const jpeg_transform &other) = delete;
+    jpeg_transform &operator=(const jpeg_transform &other) = delete;
+
+    jpeg_transform_private *m = nullptr;
+};
+
+} // Capture
+
+#endif
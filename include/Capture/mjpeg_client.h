@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef CAPTURE_MJPEG_CLIENT_H
+#define CAPTURE_MJPEG_CLIENT_H
+
+#include <functional>
+#include <string>
+#include <chrono>
+
+namespace Capture {
+
+struct mjpeg_client_stats
+{
+    bool connected = false;
+    size_t frames = 0;
+    size_t bytes = 0;
+    size_t reconnects = 0;
+    std::chrono::steady_clock::time_point last_frame;
+};
+
+class mjpeg_client_private;
+/**
+ * Pulls many Motion-JPEG streams over HTTP on one epoll loop.
+ * Data of all streams is received into one reused buffer and parsed by Capture::mjpeg_stream,
+ * frames are reported with the id of the stream. Lost streams are reconnected.
+ * Streams are added and the loop is run by one thread, stats() and stop() could be called from any thread.
+ */
+class mjpeg_client
+{
+public:
+    using callback = std::function<void(int id, const unsigned char *data, size_t size)>;
+
+    mjpeg_client(const callback &cb, size_t buffer_size = 1 << 20);
+    ~mjpeg_client();
+
+    // http://[user:password@]host[:port]/path, credentials are "user:password" for Basic auth.
+    int add(const std::string &url, const std::string &credentials = std::string());
+    void remove(int id);
+    size_t size() const;
+
+    void set_timeout(std::chrono::milliseconds stall, std::chrono::milliseconds reconnect);
+    bool run_once(int timeout_ms = -1);
+    void run();
+    // Ends the loop for good, also if called before run().
+    void stop();
+
+    mjpeg_client_stats stats(int id) const;
+
+private:
+    mjpeg_client(const mjpeg_client &other) = delete;
+    mjpeg_client &operator=(const mjpeg_client &other) = delete;
+
+    mjpeg_client_private *m = nullptr;
+};
+
+} // Capture
+
+#endif
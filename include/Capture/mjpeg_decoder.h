@@ -0,0 +1,84 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef CAPTURE_MJPEG_DECODER_H
+#define CAPTURE_MJPEG_DECODER_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace Capture {
+
+struct mjpeg_plane
+{
+    const unsigned char *data = nullptr;
+    size_t width = 0;
+    size_t height = 0;
+    size_t stride = 0;
+};
+
+// Decoded frame, its buffer is reused for next frames once it is released by the consumer.
+struct mjpeg_image
+{
+    uint64_t sequence = 0;
+    size_t width = 0;
+    size_t height = 0;
+    // Y, Cb, Cr in the subsampling of the jpeg (or only Y for grayscale), or one packed plane.
+    mjpeg_plane planes[3];
+    size_t planes_count = 0;
+
+    std::vector<unsigned char> buffer;
+};
+
+struct mjpeg_decoder_stats
+{
+    size_t decoded = 0;
+    // Frames that were not decoded or not delivered because newer ones were ready.
+    size_t skipped = 0;
+    size_t errors = 0;
+};
+
+class mjpeg_decoder_private;
+/**
+ * Decodes jpeg frames, e.g. reported by Capture::mjpeg_stream, on a pool of threads.
+ * Frames are delivered in the order they were passed to decode(), one at a time.
+ * If the consumer falls behind, stale frames are skipped: only the newest frames wait for decoding
+ * and only the newest decoded frame is delivered.
+ * A smaller size scales frames in the DCT domain, by n/8, to the smallest size that covers it.
+ */
+class mjpeg_decoder
+{
+public:
+    enum format
+    {
+        // Planar YCbCr without color conversion and upsampling.
+        yuv,
+        rgb,
+        // 32 bits per pixel, QImage::Format_RGB32 on little endian.
+        bgrx
+    };
+
+    using callback = std::function<void(std::shared_ptr<const mjpeg_image> image)>;
+
+    mjpeg_decoder(const callback &cb, format fmt = yuv, size_t threads = 0);
+    ~mjpeg_decoder();
+
+    void set_size(size_t width, size_t height);
+    // The data is copied, called by one thread.
+    void decode(const unsigned char *data, size_t size);
+
+    mjpeg_decoder_stats stats() const;
+
+private:
+    mjpeg_decoder(const mjpeg_decoder &other) = delete;
+    mjpeg_decoder &operator=(const mjpeg_decoder &other) = delete;
+
+    mjpeg_decoder_private *m = nullptr;
+};
+
+} // Capture
+
+#endif
@@ -11,6 +11,12 @@
 namespace Capture {
 
 class mjpeg_stream_private;
+/**
+ * Parses multipart/x-mixed-replace stream of jpeg images.
+ * A frame that is contiguous in the chunk passed to read() is reported as a pointer into the chunk,
+ * only frames split between chunks are copied. Without Content-Length a frame ends
+ * at the next boundary, or at JPEG EOI if no boundary is known.
+ */
 class mjpeg_stream
 {
 public:
@@ -7,10 +7,77 @@
 
 #include <string>
 #include <functional>
+#include <memory>
+#include <chrono>
+#include <vector>
 
 namespace Capture {
 
+/**
+ * Limits of outbound bytes queued in user space for lagging clients.
+ * A frame that does not fit is skipped. A client that stays over the budget
+ * longer than grace is downgraded: it gets a new frame only when the previous
+ * one is fully sent. It is disconnected if it stays over the budget for timeout.
+ * Zero means unlimited.
+ */
+struct send_budget
+{
+    size_t per_connection = 0;
+    size_t global = 0;
+    std::chrono::milliseconds grace{ 2000 };
+    std::chrono::milliseconds timeout{ 10000 };
+};
+
+/**
+ * A client is disconnected if queued data makes no progress for write,
+ * or if nothing is sent to it for idle. Zero disables the deadline.
+ */
+struct socket_deadlines
+{
+    std::chrono::milliseconds write{ 0 };
+    std::chrono::milliseconds idle{ 0 };
+};
+
+/**
+ * Options applied to accepted sockets.
+ * Send buffer is sized in frames, zero values keep kernel defaults.
+ */
+struct socket_profile
+{
+    bool no_delay = false;
+    int notsent_lowat = 0;
+    float sndbuf_frames = 0;
+    int tos = 0;
+    int busy_poll_usec = 0;
+
+    // Keeps as few frames as possible queued in the kernel.
+    static socket_profile low_latency();
+    // Lets the kernel batch several frames per write.
+    static socket_profile throughput();
+};
+
+struct socket_stats
+{
+    size_t queued = 0;
+    size_t frames_sent = 0;
+    size_t frames_skipped = 0;
+    bool downgraded = false;
+};
+
+// Link estimates of the kernel, TCP_INFO.
+struct socket_link
+{
+    std::chrono::microseconds rtt{ 0 };
+    // Bytes per second of the latest delivered data, 0 if unknown.
+    uint64_t delivery_rate = 0;
+    // The rate was limited by the application, not by the link.
+    bool app_limited = false;
+    // Bytes acknowledged by the peer.
+    uint64_t bytes_acked = 0;
+};
+
 class socket;
+class timer_wheel;
 class socket_listener_private;
 class socket_listener
 {
@@ -18,7 +85,14 @@ public:
     socket_listener();
     ~socket_listener();
     bool listen(const std::string &host, int port);
+    bool use_tls(const std::string &cert_file, const std::string &key_file);
+    bool is_tls() const;
+    // Accepted connection must finish TLS handshake and send its request within the timeout.
+    void set_handshake_timeout(std::chrono::milliseconds timeout);
+    void set_profile(const socket_profile &profile, size_t frame_size);
     void close();
+    // Waits for connections without blocking on any of them,
+    // f is called for those that completed TLS handshake and sent the request header.
     void accept(const std::function<void(socket &&)> &f) const;
 
 private:
@@ -32,15 +106,41 @@ class socket_private;
 class socket
 {
 public:
-    socket(const socket &&other);
+    socket(socket &&other);
+    socket &operator=(socket &&other);
     ~socket();
 
     int fd() const;
+    std::string peer() const;
     void close();
+    int read(void *data, size_t size, int timeout_ms = -1);
     bool write(const std::string &str);
     bool write(const void *str, size_t size);
+    bool is_tls() const;
+    bool is_ktls() const;
+    bool tune(const socket_profile &profile, size_t frame_size);
     operator bool() const;
 
+    // Non-blocking output: data is referenced, not copied, until it is sent.
+    bool queue(const std::shared_ptr<const void> &data, size_t size);
+    bool flush();
+    size_t queued() const;
+    static size_t total_queued();
+
+    // Whether a frame of segments entries fits the budget and the queue, it is counted as sent or skipped.
+    // The global budget is applied only to a socket that has unsent data.
+    bool admit(size_t frame_size, const send_budget &budget, size_t segments = 1);
+    socket_stats stats() const;
+    bool link(socket_link &link) const;
+
+    // Tracks the deadlines in the wheel, the socket is aborted when one expires.
+    void watch(timer_wheel &wheel, const socket_deadlines &deadlines);
+    bool is_watched() const;
+
+    // State of the application attached to the connection, e.g. what the client requested.
+    void set_context(const std::shared_ptr<void> &context);
+    const std::shared_ptr<void> &context() const;
+
 private:
     socket(int fd);
     socket(const socket &other) = delete;
@@ -50,6 +150,21 @@ private:
     friend class socket_listener;
 };
 
+/**
+ * Buffers for socket::queue() that are reused as soon as no socket references them,
+ * so a steady stream of frames is sent without heap allocations.
+ * get() is called by one thread, references could be released by any.
+ */
+class buffer_pool
+{
+public:
+    std::shared_ptr<std::string> get();
+    size_t size() const;
+
+private:
+    std::vector<std::shared_ptr<std::string>> buffers;
+};
+
 class http_request_private;
 class http_request
 {
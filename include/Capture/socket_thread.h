@@ -5,6 +5,8 @@
 #ifndef CAPTURE_SOCKET_THREAD_H
 #define CAPTURE_SOCKET_THREAD_H
 
+#include "socket.h"
+
 #include <string>
 #include <functional>
 #include <vector>
@@ -23,9 +25,14 @@ public:
     ~socket_thread();
 
     void push(socket &&s);
+    void set_deadlines(const socket_deadlines &deadlines);
     void start(const std::function<void(sockets &)> &f);
     void stop();
 
+    // When a deadline of a client could expire, the callback should not wait for longer.
+    // Called by the callback only.
+    std::chrono::steady_clock::time_point next_deadline() const;
+
 private:
     socket_thread(const socket_thread &other) = delete;
     socket_thread &operator=(const socket_thread &other) = delete;
@@ -0,0 +1,78 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#ifndef CAPTURE_TIMER_WHEEL_H
+#define CAPTURE_TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace Capture {
+
+/**
+ * Hierarchical timer wheel: 4 levels of 64 slots.
+ * Scheduling, rescheduling and cancelling of a timer is O(1),
+ * timers are intrusive so no allocations are done by the wheel.
+ * Not thread safe, expected to be used by one thread.
+ */
+class timer_wheel
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    class timer
+    {
+    public:
+        timer() = default;
+        ~timer();
+
+        bool is_active() const { return next; }
+        std::function<void()> expired;
+
+    private:
+        timer(const timer &other) = delete;
+        timer &operator=(const timer &other) = delete;
+
+        void unlink();
+
+        timer_wheel *wheel = nullptr;
+        timer *prev = nullptr;
+        timer *next = nullptr;
+        uint64_t expires = 0;
+        friend class timer_wheel;
+    };
+
+    timer_wheel(std::chrono::milliseconds resolution = std::chrono::milliseconds(10));
+    ~timer_wheel();
+
+    void schedule(timer &t, clock::time_point when);
+    void cancel(timer &t);
+    size_t advance(clock::time_point now = clock::now());
+    size_t size() const;
+    // Not later than the first timer fires, time_point::max() without timers.
+    clock::time_point next_expiry() const;
+
+private:
+    timer_wheel(const timer_wheel &other) = delete;
+    timer_wheel &operator=(const timer_wheel &other) = delete;
+
+    static const unsigned bits = 6;
+    static const unsigned slots = 1 << bits;
+    static const unsigned levels = 4;
+
+    uint64_t ticks(clock::time_point t) const;
+    void add(timer &t);
+    unsigned cascade(unsigned level, unsigned index);
+
+    clock::time_point start;
+    std::chrono::milliseconds resolution;
+    uint64_t current = 0;
+    size_t count = 0;
+    timer wheel[levels][slots];
+};
+
+} // Capture
+
+#endif
@@ -5,10 +5,45 @@
 #ifndef CAPTURE_V4L2_H
 #define CAPTURE_V4L2_H
 
+#include <chrono>
+#include <functional>
 #include <string>
+#include <vector>
 
 namespace Capture {
 
+// Format, size and rate of frames of a device.
+struct v4l2_mode
+{
+    unsigned pixel_format = 0;
+    size_t width = 0;
+    size_t height = 0;
+    // Seconds per frame, 0 if not known.
+    unsigned interval_numerator = 0;
+    unsigned interval_denominator = 0;
+
+    double fps() const { return interval_numerator ? double(interval_denominator) / interval_numerator : 0; }
+};
+
+// Counters of a device since start(), tell frames lost by the driver from frames lost by the application.
+struct v4l2_stats
+{
+    // Frames read by the application.
+    size_t frames = 0;
+    // Gaps of sequence numbers while the driver had a free buffer: dropped by the device, e.g. no USB bandwidth.
+    size_t lost = 0;
+    // Gaps while every buffer waited for the application, e.g. nothing was read without clients.
+    size_t overrun = 0;
+    // Buffers flagged by V4L2_BUF_FLAG_ERROR, the data could be corrupted.
+    size_t errors = 0;
+    // Requeued unread by the latest only mode.
+    size_t skipped = 0;
+    // From the capture timestamp to the dequeue of read frames, known only for monotonic timestamps.
+    size_t latency_count = 0;
+    std::chrono::microseconds latency_sum{ 0 };
+    std::chrono::microseconds latency_max{ 0 };
+};
+
 class v4l2_frame_private;
 class v4l2_frame
 {
@@ -24,9 +59,26 @@ public:
     size_t width() const;
     size_t height() const;
     unsigned pixel_format() const;
+    // The first plane, the size of all planes.
     const void *data() const;
     size_t size() const;
+    // Planes of the image: luma and chroma of NV12 and NV16 even if the driver puts them into one buffer,
+    // planes of the driver for multi-planar formats, the whole frame otherwise.
+    size_t planes_count() const;
+    const void *plane_data(size_t plane) const;
+    size_t plane_size(size_t plane) const;
+    // Bytes per line, 0 for compressed frames.
+    size_t plane_stride(size_t plane) const;
     struct timeval timestamp() const;
+    // Numbered by the driver, a gap is a frame it lost.
+    unsigned sequence() const;
+    // V4L2_BUF_FLAG_*, e.g. V4L2_BUF_FLAG_ERROR if the data could be corrupted.
+    unsigned flags() const;
+    // The timestamp is of CLOCK_MONOTONIC, otherwise it could be of another clock or copied from an output.
+    bool monotonic_timestamp() const;
+    // DMABUF of the device buffer that holds the frame, -1 if not exported or if it is a copy.
+    // Valid as long as the frame data.
+    int dmabuf_fd() const;
 
     v4l2_frame convert(unsigned pixel_format) const;
 
@@ -39,15 +91,54 @@ class v4l2_private;
 class v4l2
 {
 public:
+    // The frame is valid only within the callback.
+    using frame_callback = std::function<void(const v4l2_frame &frame)>;
+    // Buffers mapped from the driver or allocated by the application (V4L2_MEMORY_USERPTR),
+    // optionally on hugepages to save TLB misses when frames are read.
+    enum memory_type { memory_mmap, memory_userptr, memory_hugepages };
+
     v4l2(const std::string &device);
     ~v4l2();
 
+    // Enumerated modes are searched for the one that covers the size and the rate at the lowest CPU cost.
+    // Without a pixel format it is Motion-JPEG or a raw format that convert() encodes, Motion-JPEG is copied
+    // but raw frames are encoded, so a larger Motion-JPEG mode could be chosen.
     bool start(size_t width_hint = 0, size_t height_hint = 0, unsigned pixel_format = 0, size_t buffers_count = 5);
     void stop();
     bool is_active() const;
 
+    // Every read takes the newest ready frame and requeues the older ones at once,
+    // a consumer that falls behind gets fresh frames instead of queued ones.
+    // The buffer of the frame stays dequeued until the next read, at least 3 buffers are needed.
+    void set_latest_only(bool latest);
+    // Used by the next start(), the driver might not support user pointers.
+    void set_memory(memory_type memory);
+    memory_type memory() const;
+    // Memory mapped buffers are exported by VIDIOC_EXPBUF, see v4l2_frame::dmabuf_fd().
+    void set_dmabuf_export(bool enable);
+    // Requested frames per second, set by VIDIOC_S_PARM. 0 keeps the rate of the driver.
+    void set_frame_rate(unsigned fps);
+    // All modes of the device, opened for it if it is not started.
+    std::vector<v4l2_mode> modes() const;
+    // Mode chosen by start().
+    v4l2_mode mode() const;
+    // Frames requeued unread by the latest only mode.
+    size_t frames_skipped() const;
+    v4l2_stats stats() const;
+
+    // Waits for a frame, at most 2 seconds.
     v4l2_frame read_frame() const;
 
+    // Integration with an external event loop, e.g. to serve many devices and sockets by one thread.
+    // The fd is non-blocking and readable when a frame is ready, -1 if not started.
+    int fd() const;
+    // Returns immediately, an empty frame if none is ready.
+    v4l2_frame try_read_frame() const;
+    void set_callback(const frame_callback &cb);
+    // Called by the loop when the fd is readable, passes all ready frames (or only the newest one) to the callback.
+    // Returns false if the device is lost.
+    bool on_readable();
+
     std::string device() const;
     size_t image_size() const;
     size_t native_width() const;
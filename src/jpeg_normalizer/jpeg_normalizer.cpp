@@ -0,0 +1,188 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "Capture/jpeg_normalizer.h"
+
+#include <string.h>
+
+namespace Capture {
+
+// DHT segment of the tables of JPEG Annex K.3, luma and chroma DC and AC, as libjpeg writes them.
+static const unsigned char standard_huffman[] = {
+    0xFF, 0xC4, 0x01, 0xA2,
+    0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x10, 0x00, 0x02,
+    0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7D, 0x01, 0x02,
+    0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71,
+    0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0, 0x24, 0x33,
+    0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x53,
+    0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x73,
+    0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x92,
+    0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9,
+    0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7,
+    0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2, 0xE3, 0xE4,
+    0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA,
+    0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x11, 0x00, 0x02,
+    0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77, 0x00, 0x01,
+    0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22,
+    0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0, 0x15, 0x62,
+    0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A,
+    0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A,
+    0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE2, 0xE3,
+    0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA
+};
+
+struct jpeg_normalizer_private
+{
+    bool strip = false;
+    jpeg_normalizer_stats stats;
+};
+
+jpeg_normalizer::jpeg_normalizer()
+    : m(new jpeg_normalizer_private)
+{
+}
+
+jpeg_normalizer::~jpeg_normalizer()
+{
+    delete m;
+}
+
+void jpeg_normalizer::set_strip_metadata(bool strip)
+{
+    m->strip = strip;
+}
+
+jpeg_normalizer_stats jpeg_normalizer::stats() const
+{
+    return m->stats;
+}
+
+bool jpeg_normalizer::normalize(const void *data, size_t size, std::string &output)
+{
+    auto b = (const unsigned char *)data;
+    auto &stats = m->stats;
+    output.clear();
+    ++stats.frames;
+    if (size < 4 || b[0] != 0xFF || b[1] != 0xD8) {
+        ++stats.invalid;
+        return false;
+    }
+
+    output.reserve(size + sizeof(standard_huffman));
+    // Bytes are copied in ranges, only dropped segments and inserted tables split them.
+    size_t copied = 0;
+    auto flush = [&](size_t until) {
+        output.append((const char *)b + copied, until - copied);
+        copied = until;
+    };
+
+    size_t pos = 2;
+    bool huffman = false;
+    bool entropy = false;
+    bool truncated = false;
+    bool invalid = false;
+    while (true) {
+        if (entropy) {
+            auto p = (const unsigned char *)memchr(b + pos, 0xFF, size - pos);
+            if (!p || size_t(p - b) + 1 >= size) {
+                truncated = true;
+                break;
+            }
+
+            pos = p - b;
+            unsigned char marker = b[pos + 1];
+            // Stuffed byte or restart marker.
+            if (!marker || (marker >= 0xD0 && marker <= 0xD7)) {
+                pos += 2;
+                continue;
+            }
+            entropy = false;
+        }
+
+        if (pos + 2 > size) {
+            truncated = true;
+            break;
+        }
+        if (b[pos] != 0xFF) {
+            invalid = true;
+            break;
+        }
+
+        unsigned char marker = b[pos + 1];
+        // Fill bytes.
+        if (marker == 0xFF) {
+            ++pos;
+            continue;
+        }
+        if (marker == 0xD9) {
+            pos += 2;
+            break;
+        }
+        if (marker == 0xD8) {
+            invalid = true;
+            break;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2;
+            continue;
+        }
+
+        if (pos + 4 > size) {
+            truncated = true;
+            break;
+        }
+
+        size_t length = (b[pos + 2] << 8) | b[pos + 3];
+        size_t end = pos + 2 + length;
+        if (length < 2) {
+            invalid = true;
+            break;
+        }
+        if (end > size) {
+            truncated = true;
+            break;
+        }
+
+        if (marker == 0xC4) {
+            huffman = true;
+        } else if (marker == 0xDA) {
+            if (!huffman) {
+                flush(pos);
+                output.append((const char *)standard_huffman, sizeof(standard_huffman));
+                huffman = true;
+                ++stats.huffman_inserted;
+            }
+            entropy = true;
+        } else if (m->strip && (marker == 0xFE || (marker >= 0xE0 && marker <= 0xEF))) {
+            // Both tell decoders the colour space.
+            bool jfif = marker == 0xE0 && length >= 7 && !memcmp(b + pos + 4, "JFIF", 5);
+            bool adobe = marker == 0xEE && length >= 7 && !memcmp(b + pos + 4, "Adobe", 5);
+            if (!jfif && !adobe) {
+                flush(pos);
+                copied = end;
+                stats.stripped_bytes += end - pos;
+            }
+        }
+        pos = end;
+    }
+
+    if (truncated || invalid) {
+        ++(truncated ? stats.truncated : stats.invalid);
+        output.clear();
+        return false;
+    }
+
+    flush(pos);
+    stats.trimmed_bytes += size - pos;
+    return true;
+}
+
+} // Capture
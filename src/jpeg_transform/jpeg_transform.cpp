@@ -0,0 +1,359 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "Capture/jpeg_transform.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+namespace Capture {
+
+struct error_mgr
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+static void error_exit(j_common_ptr cinfo)
+{
+    longjmp(((error_mgr *)cinfo->err)->jump, 1);
+}
+
+static void output_message(j_common_ptr)
+{
+}
+
+// Writes compressed data to a string, its capacity is reused.
+struct string_dest
+{
+    struct jpeg_destination_mgr pub;
+    std::string *output = nullptr;
+};
+
+static void init_destination(j_compress_ptr cinfo)
+{
+    auto dest = (string_dest *)cinfo->dest;
+    auto &out = *dest->output;
+    out.resize(std::max<size_t>(out.capacity(), 64 << 10));
+    dest->pub.next_output_byte = (JOCTET *)&out[0];
+    dest->pub.free_in_buffer = out.size();
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo)
+{
+    auto dest = (string_dest *)cinfo->dest;
+    auto &out = *dest->output;
+    size_t used = out.size();
+    out.resize(used * 2);
+    dest->pub.next_output_byte = (JOCTET *)&out[used];
+    dest->pub.free_in_buffer = out.size() - used;
+    return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo)
+{
+    auto dest = (string_dest *)cinfo->dest;
+    dest->output->resize(dest->output->size() - dest->pub.free_in_buffer);
+}
+
+struct jpeg_transform_private
+{
+    jpeg_decompress_struct d;
+    jpeg_compress_struct c;
+    error_mgr err;
+    string_dest dest;
+    std::vector<unsigned char> rows_buffer;
+
+    bool scale(const void *data, size_t size, size_t width, unsigned eighths, std::string &output, int quality);
+};
+
+jpeg_transform::jpeg_transform()
+    : m(new jpeg_transform_private)
+{
+    m->d.err = jpeg_std_error(&m->err.pub);
+    m->c.err = &m->err.pub;
+    m->err.pub.error_exit = error_exit;
+    m->err.pub.output_message = output_message;
+    jpeg_create_decompress(&m->d);
+    jpeg_create_compress(&m->c);
+
+    m->dest.pub.init_destination = init_destination;
+    m->dest.pub.empty_output_buffer = empty_output_buffer;
+    m->dest.pub.term_destination = term_destination;
+    m->c.dest = &m->dest.pub;
+}
+
+jpeg_transform::~jpeg_transform()
+{
+    jpeg_destroy_decompress(&m->d);
+    m->c.dest = nullptr;
+    jpeg_destroy_compress(&m->c);
+    delete m;
+}
+
+bool jpeg_transform::scale(const void *data, size_t size, size_t width, std::string &output, int quality)
+{
+    return m->scale(data, size, width, 0, output, quality);
+}
+
+bool jpeg_transform::scale_by(const void *data, size_t size, unsigned eighths, std::string &output, int quality)
+{
+    return m->scale(data, size, 0, eighths, output, quality);
+}
+
+bool jpeg_transform_private::scale(const void *data, size_t size, size_t width, unsigned eighths, std::string &output, int quality)
+{
+    // Changed after setjmp(), kept in memory so longjmp() could not clobber it.
+    volatile unsigned n = eighths;
+    if (setjmp(err.jump)) {
+        jpeg_abort_decompress(&d);
+        jpeg_abort_compress(&c);
+        output.clear();
+        return false;
+    }
+
+    jpeg_mem_src(&d, (unsigned char *)data, size);
+    jpeg_read_header(&d, TRUE);
+
+    if (!n) {
+        n = 1;
+        while (n < 8 && (d.image_width * n + 7) / 8 < width)
+            ++n;
+    }
+    if (n >= 8) {
+        jpeg_abort_decompress(&d);
+        output.clear();
+        return true;
+    }
+
+    d.scale_num = n;
+    d.scale_denom = 8;
+    // Samples stay in YCbCr, no color conversion on both sides.
+    if (d.jpeg_color_space != JCS_YCbCr && d.jpeg_color_space != JCS_GRAYSCALE)
+        d.out_color_space = JCS_RGB;
+    else
+        d.out_color_space = d.jpeg_color_space;
+    jpeg_start_decompress(&d);
+
+    dest.output = &output;
+    c.image_width = d.output_width;
+    c.image_height = d.output_height;
+    c.input_components = d.output_components;
+    c.in_color_space = d.out_color_space;
+    jpeg_set_defaults(&c);
+    jpeg_set_quality(&c, quality, TRUE);
+    jpeg_start_compress(&c, TRUE);
+
+    const size_t stride = d.output_width * d.output_components;
+    const size_t count = std::max(1, d.rec_outbuf_height);
+    rows_buffer.resize(stride * count);
+    JSAMPROW rows[16];
+    for (size_t i = 0; i < count && i < 16; ++i)
+        rows[i] = rows_buffer.data() + i * stride;
+
+    while (d.output_scanline < d.output_height) {
+        auto read = jpeg_read_scanlines(&d, rows, std::min<size_t>(count, 16));
+        if (!read)
+            break;
+        jpeg_write_scanlines(&c, rows, read);
+    }
+
+    jpeg_finish_compress(&c);
+    jpeg_abort_decompress(&d);
+    return true;
+}
+
+// Rounds coef * from / to to the nearest integer.
+static JCOEF rescale(JCOEF coef, unsigned from, unsigned to)
+{
+    long v = long(coef) * from;
+    return JCOEF(v >= 0 ? (v + to / 2) / to : -((-v + to / 2) / to));
+}
+
+bool jpeg_transform::requantize(const void *data, size_t size, int quality, std::string &output,
+    bool drop_chroma, bool optimize_huffman)
+{
+    auto &d = m->d;
+    auto &c = m->c;
+    if (setjmp(m->err.jump)) {
+        jpeg_abort_decompress(&d);
+        jpeg_abort_compress(&c);
+        output.clear();
+        return false;
+    }
+
+    jpeg_mem_src(&d, (unsigned char *)data, size);
+    jpeg_read_header(&d, TRUE);
+    auto coefs = jpeg_read_coefficients(&d);
+
+    jpeg_copy_critical_parameters(&d, &c);
+    // Standard tables of the quality, never finer than the current ones.
+    jpeg_set_quality(&c, quality, TRUE);
+    bool changed = drop_chroma && d.num_components > 1;
+    for (int ci = 0; ci < d.num_components; ++ci) {
+        auto from = d.comp_info[ci].quant_table;
+        auto to = c.quant_tbl_ptrs[c.comp_info[ci].quant_tbl_no];
+        if (!from || !to) {
+            jpeg_abort_decompress(&d);
+            jpeg_abort_compress(&c);
+            output.clear();
+            return false;
+        }
+
+        for (int k = 0; k < DCTSIZE2; ++k) {
+            if (to->quantval[k] <= from->quantval[k])
+                to->quantval[k] = from->quantval[k];
+            else
+                changed = true;
+        }
+    }
+
+    if (!changed) {
+        jpeg_abort_compress(&c);
+        jpeg_abort_decompress(&d);
+        output.clear();
+        return true;
+    }
+
+    for (int ci = 0; ci < d.num_components; ++ci) {
+        auto comp = &d.comp_info[ci];
+        auto from = comp->quant_table->quantval;
+        auto to = c.quant_tbl_ptrs[c.comp_info[ci].quant_tbl_no]->quantval;
+        bool chroma = drop_chroma && ci > 0;
+        for (JDIMENSION row = 0; row < comp->height_in_blocks; row += comp->v_samp_factor) {
+            auto rows = (*d.mem->access_virt_barray)((j_common_ptr)&d, coefs[ci], row, comp->v_samp_factor, TRUE);
+            for (int r = 0; r < comp->v_samp_factor && row + r < comp->height_in_blocks; ++r) {
+                for (JDIMENSION b = 0; b < comp->width_in_blocks; ++b) {
+                    JCOEF *block = rows[r][b];
+                    for (int k = 0; k < DCTSIZE2; ++k) {
+                        // Most coefficients are zero.
+                        if (!block[k])
+                            continue;
+                        // Chroma keeps only DC and the lowest horizontal and vertical frequencies.
+                        if (chroma && k != 0 && k != 1 && k != DCTSIZE)
+                            block[k] = 0;
+                        else if (to[k] != from[k])
+                            block[k] = rescale(block[k], from[k], to[k]);
+                    }
+                }
+            }
+        }
+    }
+
+    m->dest.output = &output;
+    c.optimize_coding = optimize_huffman;
+    jpeg_write_coefficients(&c, coefs);
+    jpeg_finish_compress(&c);
+    jpeg_finish_decompress(&d);
+    return true;
+}
+
+static JDIMENSION div_round_up(size_t a, size_t b)
+{
+    return JDIMENSION((a + b - 1) / b);
+}
+
+static JDIMENSION round_up(JDIMENSION a, JDIMENSION b)
+{
+    return (a + b - 1) / b * b;
+}
+
+bool jpeg_transform::crop(const void *data, size_t size, size_t x, size_t y, size_t width, size_t height, std::string &output)
+{
+    auto &d = m->d;
+    auto &c = m->c;
+    if (setjmp(m->err.jump)) {
+        jpeg_abort_decompress(&d);
+        jpeg_abort_compress(&c);
+        output.clear();
+        return false;
+    }
+
+    jpeg_mem_src(&d, (unsigned char *)data, size);
+    jpeg_read_header(&d, TRUE);
+
+    const size_t mcu_width = d.max_h_samp_factor * DCTSIZE;
+    const size_t mcu_height = d.max_v_samp_factor * DCTSIZE;
+    const size_t x0 = x / mcu_width * mcu_width;
+    const size_t y0 = y / mcu_height * mcu_height;
+    if (!width || !height || x0 >= d.image_width || y0 >= d.image_height) {
+        jpeg_abort_decompress(&d);
+        output.clear();
+        return false;
+    }
+
+    const size_t w = std::min<size_t>(x + width, d.image_width) - x0;
+    const size_t h = std::min<size_t>(y + height, d.image_height) - y0;
+
+    // Arrays of the region must be requested before the coefficients are read.
+    jvirt_barray_ptr cropped[MAX_COMPONENTS];
+    for (int ci = 0; ci < d.num_components; ++ci) {
+        auto comp = &d.comp_info[ci];
+        cropped[ci] = (*d.mem->request_virt_barray)((j_common_ptr)&d, JPOOL_IMAGE, FALSE,
+            round_up(div_round_up(w * comp->h_samp_factor, mcu_width), comp->h_samp_factor),
+            round_up(div_round_up(h * comp->v_samp_factor, mcu_height), comp->v_samp_factor),
+            comp->v_samp_factor);
+    }
+
+    auto coefs = jpeg_read_coefficients(&d);
+    for (int ci = 0; ci < d.num_components; ++ci) {
+        auto comp = &d.comp_info[ci];
+        const JDIMENSION blocks_x = x0 / mcu_width * comp->h_samp_factor;
+        const JDIMENSION blocks_y = y0 / mcu_height * comp->v_samp_factor;
+        const JDIMENSION cols = round_up(div_round_up(w * comp->h_samp_factor, mcu_width), comp->h_samp_factor);
+        const JDIMENSION rows = round_up(div_round_up(h * comp->v_samp_factor, mcu_height), comp->v_samp_factor);
+        for (JDIMENSION row = 0; row < rows; row += comp->v_samp_factor) {
+            auto to = (*d.mem->access_virt_barray)((j_common_ptr)&d, cropped[ci], row, comp->v_samp_factor, TRUE);
+            auto from = (*d.mem->access_virt_barray)((j_common_ptr)&d, coefs[ci], blocks_y + row, comp->v_samp_factor, FALSE);
+            for (int r = 0; r < comp->v_samp_factor; ++r)
+                memcpy(to[r], from[r] + blocks_x, cols * sizeof(JBLOCK));
+        }
+    }
+
+    m->dest.output = &output;
+    jpeg_copy_critical_parameters(&d, &c);
+    c.image_width = w;
+    c.image_height = h;
+    jpeg_write_coefficients(&c, cropped);
+    jpeg_finish_compress(&c);
+    jpeg_finish_decompress(&d);
+    return true;
+}
+
+bool jpeg_transform::luma_signature(const void *data, size_t size, std::string &output)
+{
+    auto &d = m->d;
+    if (setjmp(m->err.jump)) {
+        jpeg_abort_decompress(&d);
+        output.clear();
+        return false;
+    }
+
+    jpeg_mem_src(&d, (unsigned char *)data, size);
+    jpeg_read_header(&d, TRUE);
+    // A sample per block at 1/8 is the DC coefficient, AC ones are only skipped by the entropy decoder.
+    // Chroma is not transformed for grayscale output.
+    d.scale_num = 1;
+    d.scale_denom = 8;
+    d.out_color_space = JCS_GRAYSCALE;
+    d.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&d);
+
+    output.resize(d.output_width * d.output_height);
+    while (d.output_scanline < d.output_height) {
+        JSAMPROW row = (JSAMPROW)&output[d.output_scanline * d.output_width];
+        if (!jpeg_read_scanlines(&d, &row, 1))
+            break;
+    }
+
+    jpeg_abort_decompress(&d);
+    return true;
+}
+
+} // Capture
@@ -0,0 +1,409 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "Capture/mjpeg_client.h"
+#include "Capture/mjpeg_stream.h"
+#include "Capture/timer_wheel.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+
+namespace Capture {
+
+struct connection
+{
+    int id = -1;
+    std::string host;
+    std::string port;
+    std::string request;
+    size_t sent = 0;
+    int fd = -1;
+    bool streaming = false;
+    // Response header, the body is passed to the parser.
+    std::string header;
+    std::unique_ptr<mjpeg_stream> stream;
+    // Reconnects a lost stream or drops a stalled one.
+    timer_wheel::timer timer;
+    mjpeg_client_stats stats;
+};
+
+struct mjpeg_client_private
+{
+    mjpeg_client::callback parsed;
+    std::vector<char> buffer;
+    std::vector<std::unique_ptr<connection>> connections;
+    mutable std::mutex stats_mutex;
+    timer_wheel wheel{ std::chrono::milliseconds(100) };
+    std::chrono::milliseconds stall{ 5000 };
+    std::chrono::milliseconds reconnect{ 1000 };
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    std::atomic_bool stop{ false };
+
+    void open(connection *c);
+    void close(connection *c, bool retry = true);
+    void write(connection *c);
+    void read(connection *c);
+    void expired(connection *c);
+};
+
+static std::string base64(const std::string &s)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string r;
+    size_t i = 0;
+    for (; i + 2 < s.size(); i += 3) {
+        unsigned v = (uint8_t(s[i]) << 16) | (uint8_t(s[i + 1]) << 8) | uint8_t(s[i + 2]);
+        r += table[v >> 18];
+        r += table[(v >> 12) & 63];
+        r += table[(v >> 6) & 63];
+        r += table[v & 63];
+    }
+
+    if (i < s.size()) {
+        unsigned v = uint8_t(s[i]) << 16;
+        if (i + 1 < s.size())
+            v |= uint8_t(s[i + 1]) << 8;
+        r += table[v >> 18];
+        r += table[(v >> 12) & 63];
+        r += i + 1 < s.size() ? table[(v >> 6) & 63] : '=';
+        r += '=';
+    }
+
+    return r;
+}
+
+void mjpeg_client_private::open(connection *c)
+{
+    struct addrinfo hints;
+    struct addrinfo *aip = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(c->host.c_str(), c->port.c_str(), &hints, &aip);
+    if (err != 0) {
+        std::cerr << c->host << ": " << gai_strerror(err) << std::endl;
+        wheel.schedule(c->timer, timer_wheel::clock::now() + reconnect);
+        return;
+    }
+
+    for (auto ai = aip; ai && c->fd < 0; ai = ai->ai_next) {
+        int fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            continue;
+
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            ::close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+    }
+    freeaddrinfo(aip);
+
+    if (c->fd < 0) {
+        wheel.schedule(c->timer, timer_wheel::clock::now() + reconnect);
+        return;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+
+    c->sent = 0;
+    c->streaming = false;
+    c->header.clear();
+    c->stream.reset(new mjpeg_stream([this, c](const unsigned char *data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            ++c->stats.frames;
+            c->stats.last_frame = std::chrono::steady_clock::now();
+        }
+        parsed(c->id, data, size);
+    }));
+    wheel.schedule(c->timer, timer_wheel::clock::now() + stall);
+}
+
+void mjpeg_client_private::close(connection *c, bool retry)
+{
+    if (c->fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+        ::close(c->fd);
+        c->fd = -1;
+
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        c->stats.connected = false;
+    }
+
+    if (retry)
+        wheel.schedule(c->timer, timer_wheel::clock::now() + reconnect);
+    else
+        wheel.cancel(c->timer);
+}
+
+void mjpeg_client_private::write(connection *c)
+{
+    if (!c->sent) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            close(c);
+            return;
+        }
+    }
+
+    ssize_t n = ::send(c->fd, c->request.data() + c->sent, c->request.size() - c->sent, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            close(c);
+        return;
+    }
+
+    c->sent += n;
+    if (c->sent < c->request.size())
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void mjpeg_client_private::read(connection *c)
+{
+    ssize_t n = ::recv(c->fd, buffer.data(), buffer.size(), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        close(c);
+        return;
+    }
+
+    wheel.schedule(c->timer, timer_wheel::clock::now() + stall);
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        c->stats.bytes += n;
+    }
+
+    const char *data = buffer.data();
+    if (!c->streaming) {
+        // Response header is small, it is the only part that is copied.
+        size_t prev = c->header.size();
+        c->header.append(data, std::min(size_t(n), size_t(8192)));
+        size_t e = c->header.find("\r\n\r\n");
+        if (e == std::string::npos) {
+            if (c->header.size() >= 8192)
+                close(c);
+            return;
+        }
+
+        if (c->header.compare(0, 5, "HTTP/") || c->header.find(" 200 ") > c->header.find('\n')) {
+            std::cerr << "Stream " << c->id << ": " << c->header.substr(0, c->header.find('\r')) << std::endl;
+            close(c);
+            return;
+        }
+
+        c->streaming = true;
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            c->stats.connected = true;
+        }
+
+        size_t body = e + 4 - prev;
+        data += body;
+        n -= body;
+    }
+
+    if (n > 0)
+        c->stream->read(data, n);
+}
+
+void mjpeg_client_private::expired(connection *c)
+{
+    if (c->fd >= 0) {
+        // Connected but no data.
+        close(c);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        ++c->stats.reconnects;
+    }
+    open(c);
+}
+
+mjpeg_client::mjpeg_client(const callback &cb, size_t buffer_size)
+    : m(new mjpeg_client_private)
+{
+    m->parsed = cb;
+    m->buffer.resize(buffer_size);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->event_fd, &ev);
+}
+
+mjpeg_client::~mjpeg_client()
+{
+    for (auto &c : m->connections) {
+        if (c)
+            m->close(c.get(), false);
+    }
+
+    ::close(m->event_fd);
+    ::close(m->epoll_fd);
+    delete m;
+}
+
+int mjpeg_client::add(const std::string &url, const std::string &credentials)
+{
+    static const std::string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme))
+        return -1;
+
+    auto c = std::make_unique<connection>();
+    size_t b = scheme.size();
+    size_t e = url.find('/', b);
+    std::string authority = url.substr(b, e == std::string::npos ? std::string::npos : e - b);
+    std::string path = e == std::string::npos ? "/" : url.substr(e);
+    std::string auth = credentials;
+
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos) {
+        if (auth.empty())
+            auth = authority.substr(0, at);
+        authority = authority.substr(at + 1);
+    }
+
+    c->host = authority;
+    c->port = "80";
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+        c->host = authority.substr(0, colon);
+        c->port = authority.substr(colon + 1);
+    }
+    if (c->host.size() > 1 && c->host.front() == '[' && c->host.back() == ']')
+        c->host = c->host.substr(1, c->host.size() - 2);
+    if (c->host.empty())
+        return -1;
+
+    // HTTP/1.0 keeps the body free of chunked encoding.
+    c->request = "GET " + path + " HTTP/1.0\r\n";
+    c->request += "Host: " + authority + "\r\n";
+    if (!auth.empty())
+        c->request += "Authorization: Basic " + base64(auth) + "\r\n";
+    c->request += "\r\n";
+
+    auto p = c.get();
+    c->timer.expired = [this, p] { m->expired(p); };
+    {
+        // stats() could index the connections from another thread.
+        std::lock_guard<std::mutex> lock(m->stats_mutex);
+        c->id = int(m->connections.size());
+        m->connections.push_back(std::move(c));
+    }
+    m->open(p);
+
+    return p->id;
+}
+
+void mjpeg_client::remove(int id)
+{
+    if (id < 0 || size_t(id) >= m->connections.size() || !m->connections[id])
+        return;
+
+    m->close(m->connections[id].get(), false);
+    std::lock_guard<std::mutex> lock(m->stats_mutex);
+    m->connections[id].reset();
+}
+
+size_t mjpeg_client::size() const
+{
+    size_t r = 0;
+    for (auto &c : m->connections)
+        r += c ? 1 : 0;
+    return r;
+}
+
+void mjpeg_client::set_timeout(std::chrono::milliseconds stall, std::chrono::milliseconds reconnect)
+{
+    m->stall = stall;
+    m->reconnect = reconnect;
+}
+
+bool mjpeg_client::run_once(int timeout_ms)
+{
+    // Timers are checked at least with the resolution of the wheel.
+    if (m->wheel.size() && (timeout_ms < 0 || timeout_ms > 100))
+        timeout_ms = 100;
+
+    struct epoll_event events[64];
+    int n = epoll_wait(m->epoll_fd, events, 64, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        return false;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        auto c = (connection *)events[i].data.ptr;
+        if (!c) {
+            uint64_t count = 0;
+            if (::read(m->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                perror("eventfd");
+            continue;
+        }
+
+        if (c->fd < 0)
+            continue;
+        if (events[i].events & EPOLLOUT)
+            m->write(c);
+        if (c->fd >= 0 && events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            m->read(c);
+    }
+
+    m->wheel.advance();
+    return !m->stop;
+}
+
+void mjpeg_client::run()
+{
+    while (run_once());
+}
+
+void mjpeg_client::stop()
+{
+    m->stop = true;
+    uint64_t one = 1;
+    if (::write(m->event_fd, &one, sizeof(one)) < 0)
+        perror("eventfd");
+}
+
+mjpeg_client_stats mjpeg_client::stats(int id) const
+{
+    std::lock_guard<std::mutex> lock(m->stats_mutex);
+    if (id < 0 || size_t(id) >= m->connections.size() || !m->connections[id])
+        return mjpeg_client_stats();
+    return m->connections[id]->stats;
+}
+
+} // Capture
@@ -0,0 +1,370 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "Capture/mjpeg_decoder.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+#if JPEG_LIB_VERSION >= 70
+#define DCT_SCALED_SIZE(c) (c)->DCT_v_scaled_size
+#define MIN_DCT_SCALED_SIZE(c) (c)->min_DCT_v_scaled_size
+#else
+#define DCT_SCALED_SIZE(c) (c)->DCT_scaled_size
+#define MIN_DCT_SCALED_SIZE(c) (c)->min_DCT_scaled_size
+#endif
+
+namespace Capture {
+
+struct decode_job
+{
+    uint64_t sequence = 0;
+    std::vector<unsigned char> input;
+    bool done = false;
+    std::shared_ptr<mjpeg_image> image;
+};
+
+struct mjpeg_decoder_private
+{
+    mjpeg_decoder::callback decoded;
+    mjpeg_decoder::format format = mjpeg_decoder::yuv;
+    std::atomic<size_t> width{ 0 };
+    std::atomic<size_t> height{ 0 };
+
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    bool stop = false;
+    uint64_t sequence = 0;
+    // Jobs to decode, at most one per thread waits.
+    std::deque<decode_job *> waiting;
+    // Jobs in order of decode() that are not delivered yet.
+    std::deque<decode_job *> order;
+    bool delivering = false;
+    // A frame was decoded while the consumer was busy.
+    bool behind = false;
+    std::vector<std::unique_ptr<decode_job>> jobs;
+    std::vector<decode_job *> free_jobs;
+    std::vector<std::shared_ptr<mjpeg_image>> images;
+    mjpeg_decoder_stats stats;
+
+    std::vector<std::thread> threads;
+
+    decode_job *take_job();
+    void recycle(decode_job *j);
+    std::shared_ptr<mjpeg_image> take_image();
+    void run();
+    void deliver(std::unique_lock<std::mutex> &lock);
+};
+
+struct error_mgr
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+static void error_exit(j_common_ptr cinfo)
+{
+    longjmp(((error_mgr *)cinfo->err)->jump, 1);
+}
+
+// Corrupt data warnings are frequent in streams, the frame is delivered as decoded.
+static void output_message(j_common_ptr)
+{
+}
+
+// Smallest n/8 scale that covers the requested size.
+static unsigned scale(size_t width, size_t height, size_t max_width, size_t max_height)
+{
+    if (!max_width && !max_height)
+        return 8;
+
+    unsigned n = 1;
+    for (; n < 8; ++n) {
+        if ((width * n + 7) / 8 >= max_width && (height * n + 7) / 8 >= max_height)
+            break;
+    }
+    return n;
+}
+
+static void read_yuv(jpeg_decompress_struct &cinfo, mjpeg_image &image)
+{
+    size_t offsets[3] = {};
+    size_t total = 0;
+    image.planes_count = std::min(cinfo.num_components, 3);
+    for (size_t i = 0; i < image.planes_count; ++i) {
+        auto c = &cinfo.comp_info[i];
+        auto &plane = image.planes[i];
+        plane.width = c->downsampled_width;
+        plane.height = c->downsampled_height;
+        // Whole blocks are written, rows are aligned.
+        plane.stride = (c->width_in_blocks * DCT_SCALED_SIZE(c) + 31) & ~size_t(31);
+        offsets[i] = total;
+        total += plane.stride * cinfo.total_iMCU_rows * c->v_samp_factor * DCT_SCALED_SIZE(c);
+    }
+
+    image.buffer.resize(total);
+    for (size_t i = 0; i < image.planes_count; ++i)
+        image.planes[i].data = image.buffer.data() + offsets[i];
+
+    const int rows = cinfo.max_v_samp_factor * MIN_DCT_SCALED_SIZE(&cinfo);
+    JSAMPROW rows_y[64], rows_cb[64], rows_cr[64];
+    JSAMPARRAY planes[3] = { rows_y, rows_cb, rows_cr };
+    for (size_t imcu = 0; cinfo.output_scanline < cinfo.output_height; ++imcu) {
+        for (size_t i = 0; i < image.planes_count; ++i) {
+            auto c = &cinfo.comp_info[i];
+            size_t n = c->v_samp_factor * DCT_SCALED_SIZE(c);
+            auto p = image.buffer.data() + offsets[i] + imcu * n * image.planes[i].stride;
+            for (size_t r = 0; r < n; ++r)
+                planes[i][r] = p + r * image.planes[i].stride;
+        }
+
+        if (!jpeg_read_raw_data(&cinfo, planes, rows))
+            break;
+    }
+}
+
+static void read_packed(jpeg_decompress_struct &cinfo, mjpeg_image &image)
+{
+    auto &plane = image.planes[0];
+    plane.width = cinfo.output_width;
+    plane.height = cinfo.output_height;
+    plane.stride = cinfo.output_width * cinfo.output_components;
+    image.planes_count = 1;
+    image.buffer.resize(plane.stride * plane.height);
+    plane.data = image.buffer.data();
+
+    JSAMPROW rows[4];
+    while (cinfo.output_scanline < cinfo.output_height) {
+        size_t n = std::min<size_t>(4, cinfo.output_height - cinfo.output_scanline);
+        for (size_t r = 0; r < n; ++r)
+            rows[r] = image.buffer.data() + (cinfo.output_scanline + r) * plane.stride;
+        if (!jpeg_read_scanlines(&cinfo, rows, n))
+            break;
+    }
+}
+
+static bool decode(jpeg_decompress_struct &cinfo, const decode_job &j, mjpeg_decoder::format format,
+    size_t max_width, size_t max_height, mjpeg_image &image)
+{
+    error_mgr *err = (error_mgr *)cinfo.err;
+    if (setjmp(err->jump)) {
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_mem_src(&cinfo, (unsigned char *)j.input.data(), j.input.size());
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_abort_decompress(&cinfo);
+        return false;
+    }
+
+    cinfo.scale_num = scale(cinfo.image_width, cinfo.image_height, max_width, max_height);
+    cinfo.scale_denom = 8;
+    switch (format) {
+    case mjpeg_decoder::yuv:
+        if (cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) {
+            jpeg_abort_decompress(&cinfo);
+            return false;
+        }
+        cinfo.raw_data_out = TRUE;
+        cinfo.out_color_space = cinfo.jpeg_color_space;
+        break;
+    case mjpeg_decoder::rgb:
+        cinfo.out_color_space = JCS_RGB;
+        break;
+    case mjpeg_decoder::bgrx:
+        cinfo.out_color_space = JCS_EXT_BGRX;
+        break;
+    }
+
+    jpeg_start_decompress(&cinfo);
+    image.width = cinfo.output_width;
+    image.height = cinfo.output_height;
+    if (format == mjpeg_decoder::yuv)
+        read_yuv(cinfo, image);
+    else
+        read_packed(cinfo, image);
+
+    jpeg_abort_decompress(&cinfo);
+    image.sequence = j.sequence;
+    return true;
+}
+
+mjpeg_decoder::mjpeg_decoder(const callback &cb, format fmt, size_t threads)
+    : m(new mjpeg_decoder_private)
+{
+    m->decoded = cb;
+    m->format = fmt;
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < threads; ++i)
+        m->threads.emplace_back([this] { m->run(); });
+}
+
+mjpeg_decoder::~mjpeg_decoder()
+{
+    {
+        std::lock_guard<std::mutex> lock(m->mutex);
+        m->stop = true;
+    }
+    m->cond.notify_all();
+    for (auto &t : m->threads)
+        t.join();
+
+    delete m;
+}
+
+void mjpeg_decoder::set_size(size_t width, size_t height)
+{
+    m->width = width;
+    m->height = height;
+}
+
+decode_job *mjpeg_decoder_private::take_job()
+{
+    if (free_jobs.empty()) {
+        jobs.push_back(std::make_unique<decode_job>());
+        return jobs.back().get();
+    }
+
+    auto j = free_jobs.back();
+    free_jobs.pop_back();
+    return j;
+}
+
+void mjpeg_decoder_private::recycle(decode_job *j)
+{
+    j->done = false;
+    j->image.reset();
+    free_jobs.push_back(j);
+}
+
+std::shared_ptr<mjpeg_image> mjpeg_decoder_private::take_image()
+{
+    for (auto &image : images) {
+        if (image.use_count() == 1) {
+            // Pairs with the release of the last reference by the consumer.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return image;
+        }
+    }
+
+    images.push_back(std::make_shared<mjpeg_image>());
+    return images.back();
+}
+
+void mjpeg_decoder::decode(const unsigned char *data, size_t size)
+{
+    std::unique_lock<std::mutex> lock(m->mutex);
+    auto j = m->take_job();
+    lock.unlock();
+
+    // The job is owned by this thread until it waits.
+    j->input.assign(data, data + size);
+
+    lock.lock();
+    if (m->waiting.size() >= m->threads.size()) {
+        // Decoders are busy, the oldest waiting frame is stale.
+        auto stale = m->waiting.front();
+        m->waiting.pop_front();
+        m->order.erase(std::find(m->order.begin(), m->order.end(), stale));
+        m->recycle(stale);
+        ++m->stats.skipped;
+    }
+
+    j->sequence = ++m->sequence;
+    m->waiting.push_back(j);
+    m->order.push_back(j);
+    lock.unlock();
+    m->cond.notify_one();
+}
+
+mjpeg_decoder_stats mjpeg_decoder::stats() const
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    return m->stats;
+}
+
+void mjpeg_decoder_private::run()
+{
+    jpeg_decompress_struct cinfo;
+    error_mgr err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = error_exit;
+    err.pub.output_message = output_message;
+    jpeg_create_decompress(&cinfo);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cond.wait(lock, [this] { return stop || !waiting.empty(); });
+        if (stop)
+            break;
+
+        auto j = waiting.front();
+        waiting.pop_front();
+        auto image = take_image();
+        lock.unlock();
+
+        bool ok = decode(cinfo, *j, format, width, height, *image);
+
+        lock.lock();
+        j->done = true;
+        if (ok) {
+            j->image = std::move(image);
+            ++stats.decoded;
+        } else {
+            ++stats.errors;
+        }
+
+        deliver(lock);
+    }
+
+    jpeg_destroy_decompress(&cinfo);
+}
+
+// Delivers decoded frames in order, by one thread at a time.
+void mjpeg_decoder_private::deliver(std::unique_lock<std::mutex> &lock)
+{
+    if (delivering) {
+        behind = true;
+        return;
+    }
+
+    delivering = true;
+    while (!order.empty() && order.front()->done) {
+        auto j = order.front();
+        order.pop_front();
+        // Frames were decoded while the consumer was busy, only the newest of them is delivered.
+        while (behind && !order.empty() && order.front()->done) {
+            if (j->image)
+                ++stats.skipped;
+            recycle(j);
+            j = order.front();
+            order.pop_front();
+        }
+        behind = false;
+
+        auto image = std::move(j->image);
+        recycle(j);
+        if (!image)
+            continue;
+
+        lock.unlock();
+        decoded(std::move(image));
+        lock.lock();
+    }
+    delivering = false;
+    behind = false;
+}
+
+} // Capture
@@ -5,22 +5,47 @@
 #include "Capture/mjpeg_stream.h"
 
 #include <vector>
-#include <iostream>
+#include <string.h>
+#include <strings.h>
+#include <charconv>
 
 namespace Capture {
 
+static const size_t npos = size_t(-1);
+// Longest header line that is kept, protects from a garbage stream.
+static const size_t max_line = 8192;
+
 struct mjpeg_stream_private
 {
     std::function<void(const unsigned char *, size_t)> parsed;
-    std::vector<unsigned char> vec;
+
+    bool body = false;
+    bool has_headers = false;
+    // Header line split between chunks.
+    std::string line;
     size_t content_length = 0;
+    // "\r\n--boundary", taken from the first boundary line.
+    std::string delimiter;
 
-    void parse_headers(const char *&b, const char *e);
+    // Frame split between chunks, the only bytes that are copied.
+    std::vector<unsigned char> vec;
+
+    // Resumable search of the end of a frame, relative to its beginning.
+    size_t scan = 0;
+    bool entropy = false;
+
+    const char *parse_headers(const char *b, const char *e);
+    void parse_header(const char *b, size_t size);
+    size_t find_end(const unsigned char *b, size_t size);
+    size_t find_delimiter(const unsigned char *b, size_t size);
+    size_t find_eoi(const unsigned char *b, size_t size);
+    void emit(const unsigned char *b, size_t size);
 };
 
 mjpeg_stream::mjpeg_stream(const std::function<void(const unsigned char *, size_t)> &cb)
-    : m(new mjpeg_stream_private{cb})
+    : m(new mjpeg_stream_private)
 {
+    m->parsed = cb;
 }
 
 mjpeg_stream::~mjpeg_stream()
@@ -28,50 +53,207 @@ mjpeg_stream::~mjpeg_stream()
     delete m;
 }
 
-static std::string read_line(const char *&b, const char *e)
+void mjpeg_stream_private::parse_header(const char *b, size_t size)
 {
-    std::string r;
-    while (b && b < e && *b != '\r' && *b != '\n') {
-        r += *b;
-        ++b;
+    if (size && b[size - 1] == '\r')
+        --size;
+
+    if (!size) {
+        // Empty line ends headers of a part, but not the ones before a boundary.
+        if (has_headers) {
+            body = true;
+            has_headers = false;
+        }
+        return;
+    }
+
+    has_headers = true;
+    if (size > 2 && b[0] == '-' && b[1] == '-') {
+        if (delimiter.empty())
+            delimiter = "\r\n" + std::string(b, size);
+        content_length = 0;
+        return;
     }
 
-    return r;
+    static const char cl[] = "content-length:";
+    if (size > sizeof(cl) - 1 && !strncasecmp(b, cl, sizeof(cl) - 1)) {
+        const char *v = b + sizeof(cl) - 1, *e = b + size;
+        while (v < e && (*v == ' ' || *v == '\t'))
+            ++v;
+        if (std::from_chars(v, e, content_length).ec != std::errc())
+            content_length = 0;
+    }
 }
 
-void mjpeg_stream_private::parse_headers(const char *&b, const char *e)
+const char *mjpeg_stream_private::parse_headers(const char *b, const char *e)
 {
-    std::string r;
-    do {
-        r = read_line(b, e);
-        if (r.find("Content-Length: ") != std::string::npos) {
-            content_length = size_t(std::atoi(r.substr(r.find(' ')).c_str()));
-            vec.reserve(content_length);
+    while (b < e && !body) {
+        auto nl = (const char *)memchr(b, '\n', e - b);
+        if (!nl) {
+            if (line.size() + (e - b) <= max_line)
+                line.append(b, e);
+            else
+                line.clear();
+            return e;
+        }
+
+        if (line.empty()) {
+            parse_header(b, nl - b);
+        } else {
+            line.append(b, nl);
+            parse_header(line.data(), line.size());
+            line.clear();
+        }
+        b = nl + 1;
+    }
+
+    return b;
+}
+
+size_t mjpeg_stream_private::find_delimiter(const unsigned char *b, size_t size)
+{
+    const size_t n = delimiter.size();
+    while (scan + n <= size) {
+        auto p = (const unsigned char *)memchr(b + scan, '\r', size - scan - n + 1);
+        if (!p)
+            break;
+
+        size_t i = p - b;
+        if (!memcmp(p, delimiter.data(), n))
+            return i;
+        scan = i + 1;
+    }
+
+    // Next chunk could complete the delimiter.
+    scan = size >= n ? size - n + 1 : 0;
+    return npos;
+}
+
+// Walks JPEG markers, so EOI of an embedded thumbnail is not taken for the end.
+size_t mjpeg_stream_private::find_eoi(const unsigned char *b, size_t size)
+{
+    while (scan < size) {
+        if (entropy) {
+            auto p = (const unsigned char *)memchr(b + scan, 0xFF, size - scan);
+            if (!p) {
+                scan = size;
+                return npos;
+            }
+
+            size_t i = p - b;
+            if (i + 1 >= size) {
+                scan = i;
+                return npos;
+            }
+
+            unsigned char m = b[i + 1];
+            // Stuffed byte, restart marker or fill.
+            if (!m || (m >= 0xD0 && m <= 0xD7) || m == 0xFF) {
+                scan = i + 1;
+                continue;
+            }
+            entropy = false;
+            scan = i;
+            continue;
+        }
+
+        if (b[scan] != 0xFF) {
+            // Not a marker, resync.
+            auto p = (const unsigned char *)memchr(b + scan, 0xFF, size - scan);
+            scan = p ? size_t(p - b) : size;
+            continue;
+        }
+
+        if (scan + 2 > size)
+            return npos;
+
+        unsigned char m = b[scan + 1];
+        if (m == 0xFF) {
+            ++scan;
+            continue;
+        }
+        if (m == 0xD9)
+            return scan + 2;
+        if (m == 0xD8 || m == 0x01 || (m >= 0xD0 && m <= 0xD7)) {
+            scan += 2;
+            continue;
         }
-        b += 2;
-    } while (!r.empty());
+
+        if (scan + 4 > size)
+            return npos;
+
+        scan += 2 + ((b[scan + 2] << 8) | b[scan + 3]);
+        if (m == 0xDA)
+            entropy = true;
+    }
+
+    return npos;
+}
+
+// Returns the size of the frame if it ends within the bytes.
+size_t mjpeg_stream_private::find_end(const unsigned char *b, size_t size)
+{
+    if (content_length)
+        return size >= content_length ? content_length : npos;
+    if (!delimiter.empty())
+        return find_delimiter(b, size);
+    return find_eoi(b, size);
+}
+
+void mjpeg_stream_private::emit(const unsigned char *b, size_t size)
+{
+    body = false;
+    content_length = 0;
+    scan = 0;
+    entropy = false;
+    if (size)
+        parsed(b, size);
 }
 
 void mjpeg_stream::read(const char *stream, size_t size)
 {
     const char *end = stream + size;
     while (stream < end) {
-        if (!m->content_length)
-            m->parse_headers(stream, end);
-
-        size_t len = 1;
-        if (m->content_length) {
-            size_t d = size_t(end - stream);
-            len = std::min(m->content_length - m->vec.size(), d);
-            m->vec.insert(m->vec.end(), stream, stream + len);
-            if (m->vec.size() == m->content_length) {
-                m->parsed(m->vec.data(), m->vec.size());
-                m->vec.clear();
-                m->content_length = 0;
+        if (!m->body) {
+            stream = m->parse_headers(stream, end);
+            continue;
+        }
+
+        auto b = (const unsigned char *)stream;
+        size_t n = size_t(end - stream);
+        if (m->vec.empty()) {
+            // Whole frame is in the chunk, no copies.
+            size_t len = m->find_end(b, n);
+            if (len != npos) {
+                m->emit(b, len);
+                stream += len;
+                continue;
             }
+
+            m->vec.insert(m->vec.end(), b, b + n);
+            break;
+        }
+
+        size_t prev = m->vec.size();
+        if (m->content_length)
+            n = std::min(n, m->content_length - prev);
+        m->vec.insert(m->vec.end(), b, b + n);
+
+        size_t len = m->find_end(m->vec.data(), m->vec.size());
+        if (len == npos) {
+            stream += n;
+            continue;
+        }
+
+        m->emit(m->vec.data(), len);
+        if (len >= prev) {
+            stream += len - prev;
+        } else {
+            // Delimiter started in the previous chunk, its head is kept only in the copy.
+            m->parse_headers((const char *)m->vec.data() + len, (const char *)m->vec.data() + prev);
         }
-        stream += len;
+        m->vec.clear();
     }
 }
 
-} // Capture
\ No newline at end of file
+} // Capture
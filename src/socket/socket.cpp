@@ -3,25 +3,116 @@
  */
 
 #include "Capture/socket.h"
+#include "Capture/timer_wheel.h"
 
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+// Instead of netinet/tcp.h, tcp_info of glibc misses delivery rate.
+#include <linux/tcp.h>
+#include <netinet/ip.h>
 #include <errno.h>
 #include <vector>
+#include <array>
+#include <atomic>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
 namespace Capture {
 
+using clock = std::chrono::steady_clock;
+
+// Accepted connection that is not handed over yet, events it waits for.
+struct pending_socket
+{
+    socket s;
+    short events = 0;
+};
+
 struct socket_listener_private
 {
     std::vector<int> sockets;
+    SSL_CTX *ctx = nullptr;
+    std::chrono::milliseconds handshake_timeout{ 10000 };
+    socket_profile profile;
+    size_t frame_size = 0;
+    // Handshakes and requests in progress, a silent peer must not block other connections.
+    std::vector<pending_socket> pending;
+    std::vector<struct pollfd> fds;
+};
+
+struct segment
+{
+    std::shared_ptr<const void> data;
+    size_t size = 0;
+    size_t offset = 0;
+};
+
+// Bytes queued by all sockets of the process.
+static std::atomic<size_t> queued_bytes{ 0 };
+
+struct socket_private
+{
+    int fd = -1;
+    SSL *ssl = nullptr;
+    // Session keys are installed in the kernel, the fd can be written directly.
+    bool ktls = false;
+    std::string peer;
+    clock::time_point read_deadline;
+    // Request header read by the listener, served by read() first.
+    std::string input;
+    size_t input_offset = 0;
+
+    // Ring of outbound segments, no allocations while queueing.
+    std::array<segment, 32> segments;
+    size_t head = 0;
+    size_t count = 0;
+    size_t queued = 0;
+
+    socket_stats stats;
+    std::chrono::steady_clock::time_point over_since;
+    std::chrono::steady_clock::time_point under_since;
+
+    timer_wheel *wheel = nullptr;
+    timer_wheel::timer timer;
+    socket_deadlines deadlines;
+    std::shared_ptr<void> context;
+
+    void close(bool abort = false);
+    void clear();
+    void consume(size_t bytes);
+    void touch();
+    int send(const void *data, size_t size);
 };
 
+// Milliseconds left till the deadline.
+static int remaining(clock::time_point deadline)
+{
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count();
+    return ms > 0 ? int(ms) : 0;
+}
+
+static bool wait(int fd, short events, int timeout_ms)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    int rc = 0;
+    do {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc > 0;
+}
+
 socket_listener::socket_listener()
     : m(new socket_listener_private)
 {
@@ -30,6 +121,8 @@ socket_listener::socket_listener()
 socket_listener::~socket_listener()
 {
     close();
+    if (m->ctx)
+        SSL_CTX_free(m->ctx);
     delete m;
 }
 
@@ -81,6 +174,129 @@ bool socket_listener::listen(const std::string &host, int port)
     return !m->sockets.empty();
 }
 
+bool socket_listener::use_tls(const std::string &cert_file, const std::string &key_file)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // Let OpenSSL install the negotiated keys via setsockopt(TCP_ULP, "tls")
+    // so the bulk data is encrypted by the kernel and plain write() keeps working.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // Ciphers the kernel is able to offload.
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM");
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384");
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) <= 0
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) <= 0
+        || !SSL_CTX_check_private_key(ctx)) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    if (m->ctx)
+        SSL_CTX_free(m->ctx);
+    m->ctx = ctx;
+    return true;
+}
+
+bool socket_listener::is_tls() const
+{
+    return m->ctx;
+}
+
+void socket_listener::set_handshake_timeout(std::chrono::milliseconds timeout)
+{
+    m->handshake_timeout = timeout;
+}
+
+void socket_listener::set_profile(const socket_profile &profile, size_t frame_size)
+{
+    m->profile = profile;
+    m->frame_size = frame_size;
+}
+
+// Advances TLS handshake without blocking.
+// Returns poll events to wait for, 0 when it is done or -1 on error.
+static short handshake(SSL_CTX *ctx, socket_private *s)
+{
+    if (!s->ssl) {
+        s->ssl = SSL_new(ctx);
+        if (!s->ssl)
+            return -1;
+
+        // The fd is left non-blocking, so a peer could not stall reading of a partial record.
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+        SSL_set_fd(s->ssl, s->fd);
+    }
+
+    int rc = SSL_accept(s->ssl);
+    if (rc > 0) {
+        SSL_set_mode(s->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        s->ktls = BIO_get_ktls_send(SSL_get_wbio(s->ssl));
+        return 0;
+    }
+
+    int err = SSL_get_error(s->ssl, rc);
+    if (err == SSL_ERROR_WANT_READ)
+        return POLLIN;
+    if (err == SSL_ERROR_WANT_WRITE)
+        return POLLOUT;
+
+    ERR_print_errors_fp(stderr);
+    return -1;
+}
+
+// Max size of a request header.
+static const size_t max_request = 8192;
+
+// Buffers the request header without blocking.
+// Returns poll events to wait for, 0 when the header is complete or -1 on error.
+static short read_request(socket_private *s)
+{
+    char buf[1024];
+    while (s->input.size() < max_request) {
+        int n = 0;
+        if (s->ssl) {
+            n = SSL_read(s->ssl, buf, sizeof(buf));
+            if (n <= 0) {
+                int err = SSL_get_error(s->ssl, n);
+                return err == SSL_ERROR_WANT_READ ? POLLIN : err == SSL_ERROR_WANT_WRITE ? POLLOUT : -1;
+            }
+        } else {
+            n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return POLLIN;
+            if (n <= 0)
+                return -1;
+        }
+
+        // The end could be split between reads.
+        size_t from = s->input.size() > 3 ? s->input.size() - 3 : 0;
+        s->input.append(buf, n);
+        if (s->input.find("\r\n\r\n", from) != std::string::npos)
+            return 0;
+    }
+
+    return -1;
+}
+
+// Advances the handshake, then reading of the request.
+static short prepare(SSL_CTX *ctx, socket_private *s)
+{
+    if (ctx && (!s->ssl || !SSL_is_init_finished(s->ssl))) {
+        short events = handshake(ctx, s);
+        if (events)
+            return events;
+    }
+
+    return read_request(s);
+}
+
 void socket_listener::close()
 {
     for (size_t i = 0; i < m->sockets.size(); ++i)
@@ -89,52 +305,172 @@ void socket_listener::close()
 
 void socket_listener::accept(const std::function<void(socket &&)> &f) const
 {
-    fd_set fds;
-    int max_fds = 0;
-    int err = 0;
+    auto &fds = m->fds;
+    fds.clear();
+    for (size_t i = 0; i < m->sockets.size(); ++i)
+        fds.push_back({ m->sockets[i], POLLIN, 0 });
 
-    do {
-        FD_ZERO(&fds);
-        for (size_t i = 0; i < m->sockets.size(); ++i) {
-            FD_SET(m->sockets[i], &fds);
-            if (m->sockets[i] > max_fds)
-                max_fds = m->sockets[i];
-        }
+    int timeout = -1;
+    for (auto &p : m->pending) {
+        fds.push_back({ p.s.fd(), p.events, 0 });
+        int left = remaining(p.s.m->read_deadline);
+        timeout = timeout < 0 ? left : std::min(timeout, left);
+    }
 
-        err = select(max_fds + 1, &fds, nullptr, nullptr, nullptr);
-        if (err < 0) {
-            if (errno != EINTR)
-                perror("select");
-            return;
-        }
-    } while (err <= 0);
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+        if (errno != EINTR)
+            perror("poll");
+        return;
+    }
+
+    // Connections in progress, expired ones are dropped.
+    size_t n = 0;
+    for (size_t i = 0; i < m->pending.size(); ++i) {
+        auto &p = m->pending[i];
+        if (fds[m->sockets.size() + i].revents)
+            p.events = prepare(m->ctx, p.s.m);
+        else if (!remaining(p.s.m->read_deadline))
+            p.events = -1;
+
+        if (!p.events)
+            f(std::move(p.s));
+        else if (p.events > 0 && n++ != i)
+            m->pending[n - 1] = std::move(p);
+    }
+    m->pending.erase(m->pending.begin() + n, m->pending.end());
 
     struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    for (int i = 0; i < max_fds + 1; ++i) {
-        if (!FD_ISSET(m->sockets[i], &fds))
+    for (size_t i = 0; i < m->sockets.size(); ++i) {
+        if (!fds[i].revents)
             continue;
 
+        socklen_t addr_len = sizeof(struct sockaddr_storage);
         int fd = ::accept(m->sockets[i], (struct sockaddr *)&client_addr, &addr_len);
-        f(socket(fd));
+        if (fd < 0)
+            continue;
+
+        socket s(fd);
+        s.m->read_deadline = clock::now() + m->handshake_timeout;
+        s.tune(m->profile, m->frame_size);
+        char host[NI_MAXHOST], serv[NI_MAXSERV];
+        if (getnameinfo((struct sockaddr *)&client_addr, addr_len, host, sizeof(host),
+                serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+            s.m->peer = std::string(host) + ":" + serv;
+
+        short events = prepare(m->ctx, s.m);
+        if (!events)
+            f(std::move(s));
+        else if (events > 0)
+            m->pending.push_back({ std::move(s), events });
     }
 }
 
-struct socket_private
+void socket_private::close(bool abort)
 {
-    int fd = -1;
-};
+    if (wheel)
+        wheel->cancel(timer);
+    wheel = nullptr;
+    clear();
+
+    if (ssl) {
+        if (!abort)
+            SSL_shutdown(ssl);
+        SSL_free(ssl);
+    }
+
+    if (fd > 0) {
+        if (abort) {
+            // Drop unsent data and free kernel buffers right away.
+            struct linger l = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+        }
+        ::close(fd);
+    }
+
+    fd = -1;
+    ssl = nullptr;
+    ktls = false;
+}
+
+void socket_private::touch()
+{
+    if (!wheel)
+        return;
+
+    auto timeout = queued ? deadlines.write : deadlines.idle;
+    if (timeout.count() > 0)
+        wheel->schedule(timer, clock::now() + timeout);
+    else
+        wheel->cancel(timer);
+}
+
+void socket_private::clear()
+{
+    for (; count; --count) {
+        segments[head].data.reset();
+        head = (head + 1) % segments.size();
+    }
+    head = 0;
+    queued_bytes -= queued;
+    queued = 0;
+}
+
+void socket_private::consume(size_t bytes)
+{
+    queued_bytes -= bytes;
+    queued -= bytes;
+    while (bytes) {
+        auto &s = segments[head];
+        size_t n = std::min(bytes, s.size - s.offset);
+        s.offset += n;
+        bytes -= n;
+        if (s.offset == s.size) {
+            s.data.reset();
+            head = (head + 1) % segments.size();
+            --count;
+        }
+    }
+    touch();
+}
+
+// Returns amount of written bytes, 0 if the socket would block or -1 on error.
+int socket_private::send(const void *data, size_t size)
+{
+    if (ssl && !ktls) {
+        int n = SSL_write(ssl, data, size);
+        if (n > 0)
+            return n;
+        int err = SSL_get_error(ssl, n);
+        return err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ? 0 : -1;
+    }
+
+    ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    return n;
+}
 
 socket::socket(int fd)
-    : m(new socket_private{ fd })
+    : m(new socket_private)
 {
+    m->fd = fd;
 }
 
-socket::socket(const socket &&other)
+socket::socket(socket &&other)
     : socket(-1)
 {
-    m->fd = other.m->fd;
-    other.m->fd = -1;
+    auto tmp = m;
+    m = other.m;
+    other.m = tmp;
+}
+
+socket &socket::operator=(socket &&other)
+{
+    if (this != &other) {
+        close();
+        std::swap(m, other.m);
+    }
+    return *this;
 }
 
 socket::~socket()
@@ -148,12 +484,50 @@ int socket::fd() const
     return m->fd;
 }
 
+std::string socket::peer() const
+{
+    return m->peer;
+}
+
 void socket::close()
 {
-    if (m->fd > 0)
-        ::close(m->fd);
+    m->close();
+}
 
-    m->fd = -1;
+int socket::read(void *data, size_t size, int timeout_ms)
+{
+    if (m->input_offset < m->input.size()) {
+        size_t n = std::min(size, m->input.size() - m->input_offset);
+        memcpy(data, m->input.data() + m->input_offset, n);
+        m->input_offset += n;
+        if (m->input_offset == m->input.size()) {
+            m->input.clear();
+            m->input_offset = 0;
+        }
+        return int(n);
+    }
+
+    while (m->fd >= 0) {
+        // Decrypted bytes might be already buffered by OpenSSL.
+        if (!m->ssl || !SSL_pending(m->ssl)) {
+            int timeout = timeout_ms;
+            if (m->read_deadline != clock::time_point()) {
+                int left = remaining(m->read_deadline);
+                timeout = timeout < 0 ? left : std::min(timeout, left);
+            }
+            if (!wait(m->fd, POLLIN, timeout))
+                return -1;
+        }
+
+        if (!m->ssl)
+            return ::read(m->fd, data, size);
+
+        int n = SSL_read(m->ssl, data, size);
+        if (n > 0 || SSL_get_error(m->ssl, n) != SSL_ERROR_WANT_READ)
+            return n;
+    }
+
+    return -1;
 }
 
 bool socket::write(const std::string &str)
@@ -163,16 +537,285 @@ bool socket::write(const std::string &str)
 
 bool socket::write(const void *str, size_t size)
 {
-    if (::write(m->fd, str, size) < 0)
+    auto data = (const char *)str;
+    while (size) {
+        int n = m->send(data, size);
+        if (n < 0)
+            return false;
+
+        if (!n) {
+            auto timeout = m->wheel ? m->deadlines.write.count() : 0;
+            if (!wait(m->fd, POLLOUT, timeout > 0 ? int(timeout) : -1))
+                return false;
+            continue;
+        }
+
+        data += n;
+        size -= n;
+        m->touch();
+    }
+
+    return true;
+}
+
+bool socket::queue(const std::shared_ptr<const void> &data, size_t size)
+{
+    if (m->fd < 0 || m->count == m->segments.size())
+        return false;
+    if (!size)
+        return true;
+
+    auto &s = m->segments[(m->head + m->count) % m->segments.size()];
+    s.data = data;
+    s.size = size;
+    s.offset = 0;
+    ++m->count;
+    m->queued += size;
+    queued_bytes += size;
+
+    // Waiting for write progress from now on.
+    if (m->queued == size)
+        m->touch();
+
+    return true;
+}
+
+bool socket::flush()
+{
+    if (m->fd < 0)
+        return false;
+
+    while (m->count) {
+        if (m->ssl && !m->ktls) {
+            auto &s = m->segments[m->head];
+            int n = m->send((const char *)s.data.get() + s.offset, s.size - s.offset);
+            if (n < 0)
+                return false;
+            if (!n)
+                return true;
+            m->consume(n);
+            continue;
+        }
+
+        struct iovec iov[16];
+        size_t n = 0;
+        for (; n < m->count && n < sizeof(iov) / sizeof(iov[0]); ++n) {
+            auto &s = m->segments[(m->head + n) % m->segments.size()];
+            iov[n].iov_base = (char *)s.data.get() + s.offset;
+            iov[n].iov_len = s.size - s.offset;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t bytes = sendmsg(m->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return true;
+            return false;
+        }
+        m->consume(bytes);
+    }
+
+    return true;
+}
+
+size_t socket::queued() const
+{
+    return m->queued;
+}
+
+size_t socket::total_queued()
+{
+    return queued_bytes;
+}
+
+bool socket::admit(size_t frame_size, const send_budget &budget, size_t segments)
+{
+    auto now = std::chrono::steady_clock::now();
+    auto zero = std::chrono::steady_clock::time_point();
+
+    // Downgraded client gets a frame only if the previous one is fully sent.
+    // A client that keeps up is not refused because of the others.
+    bool over = m->stats.downgraded
+        ? m->queued > 0
+        : m->count + segments > m->segments.size()
+            || (budget.per_connection && m->queued + frame_size > budget.per_connection)
+            || (budget.global && m->queued && queued_bytes + frame_size > budget.global);
+
+    if (over) {
+        m->under_since = zero;
+        if (m->over_since == zero)
+            m->over_since = now;
+
+        if (now - m->over_since > budget.timeout) {
+            close();
+            return false;
+        }
+        if (now - m->over_since > budget.grace)
+            m->stats.downgraded = true;
+
+        ++m->stats.frames_skipped;
+        return false;
+    }
+
+    m->over_since = zero;
+    if (m->under_since == zero)
+        m->under_since = now;
+    if (m->stats.downgraded && now - m->under_since > budget.grace)
+        m->stats.downgraded = false;
+
+    ++m->stats.frames_sent;
+    return true;
+}
+
+socket_stats socket::stats() const
+{
+    auto r = m->stats;
+    r.queued = m->queued;
+    return r;
+}
+
+bool socket::link(socket_link &link) const
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(m->fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
         return false;
+
+    link.rtt = std::chrono::microseconds(info.tcpi_rtt);
+    // Older kernels fill a shorter struct.
+    link.delivery_rate = len > offsetof(struct tcp_info, tcpi_delivery_rate) ? info.tcpi_delivery_rate : 0;
+    link.app_limited = info.tcpi_delivery_rate_app_limited;
+    link.bytes_acked = info.tcpi_bytes_acked;
     return true;
 }
 
+void socket::watch(timer_wheel &wheel, const socket_deadlines &deadlines)
+{
+    if (m->wheel)
+        m->wheel->cancel(m->timer);
+
+    auto p = m;
+    m->wheel = &wheel;
+    m->deadlines = deadlines;
+    m->timer.expired = [p] { p->close(true); };
+    m->touch();
+}
+
+bool socket::is_watched() const
+{
+    return m->wheel;
+}
+
+void socket::set_context(const std::shared_ptr<void> &context)
+{
+    m->context = context;
+}
+
+const std::shared_ptr<void> &socket::context() const
+{
+    return m->context;
+}
+
+bool socket::is_tls() const
+{
+    return m->ssl;
+}
+
+bool socket::is_ktls() const
+{
+    return m->ktls;
+}
+
+socket_profile socket_profile::low_latency()
+{
+    socket_profile p;
+    p.no_delay = true;
+    // Writable only when almost everything is sent, the rest waits in user space where frames could be skipped.
+    p.notsent_lowat = 16 << 10;
+    p.sndbuf_frames = 2;
+    // DSCP AF41, interactive video.
+    p.tos = 0x22 << 2;
+    p.busy_poll_usec = 50;
+    return p;
+}
+
+socket_profile socket_profile::throughput()
+{
+    socket_profile p;
+    p.sndbuf_frames = 8;
+    // DSCP AF11, high-throughput data.
+    p.tos = 0x0a << 2;
+    return p;
+}
+
+static bool set_option(int fd, int level, int name, int value, const char *s)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == 0)
+        return true;
+
+    perror(s);
+    return false;
+}
+
+bool socket::tune(const socket_profile &p, size_t frame_size)
+{
+    if (m->fd < 0)
+        return false;
+
+    bool r = true;
+    if (p.no_delay)
+        r &= set_option(m->fd, IPPROTO_TCP, TCP_NODELAY, 1, "setsockopt(TCP_NODELAY)");
+    if (p.notsent_lowat > 0)
+        r &= set_option(m->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p.notsent_lowat, "setsockopt(TCP_NOTSENT_LOWAT)");
+    if (p.sndbuf_frames > 0 && frame_size)
+        r &= set_option(m->fd, SOL_SOCKET, SO_SNDBUF, int(p.sndbuf_frames * frame_size), "setsockopt(SO_SNDBUF)");
+
+    if (p.tos > 0) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if (getsockname(m->fd, (struct sockaddr *)&addr, &len) == 0 && addr.ss_family == AF_INET6)
+            r &= set_option(m->fd, IPPROTO_IPV6, IPV6_TCLASS, p.tos, "setsockopt(IPV6_TCLASS)");
+        else
+            r &= set_option(m->fd, IPPROTO_IP, IP_TOS, p.tos, "setsockopt(IP_TOS)");
+    }
+
+#ifdef SO_BUSY_POLL
+    // Needs CAP_NET_ADMIN to exceed net.core.busy_read, not fatal.
+    if (p.busy_poll_usec > 0)
+        setsockopt(m->fd, SOL_SOCKET, SO_BUSY_POLL, &p.busy_poll_usec, sizeof(p.busy_poll_usec));
+#endif
+
+    return r;
+}
+
 socket::operator bool() const
 {
     return m->fd > 0;
 }
 
+std::shared_ptr<std::string> buffer_pool::get()
+{
+    for (auto &b : buffers) {
+        if (b.use_count() == 1) {
+            // Pairs with the release of the last reference by another thread.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return b;
+        }
+    }
+
+    buffers.push_back(std::make_shared<std::string>());
+    return buffers.back();
+}
+
+size_t buffer_pool::size() const
+{
+    return buffers.size();
+}
+
 struct http_request_private
 {
     Capture::socket &socket;
@@ -190,23 +833,9 @@ std::string http_request_private::read_line() const
     if (!socket)
         return r;
 
-    struct timeval tv;
-    fd_set fds;
-    int fd = socket.fd();
     char c = '\0';
     while (c != '\n') {
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        int rc = select(fd + 1, &fds, nullptr, nullptr, &tv);
-        if (rc <= 0) {
-            if (errno == EINTR)
-                continue;
-            break;
-        }
-
-        int bytes = ::read(fd, &c, 1);
+        int bytes = socket.read(&c, 1, 5000);
         if (bytes <= 0)
             break;
         r += c;
@@ -4,36 +4,61 @@
 
 #include "Capture/socket.h"
 #include "Capture/socket_thread.h"
+#include "Capture/timer_wheel.h"
 
 #include <thread>
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
+#include <algorithm>
 #include <iostream>
 
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 namespace Capture {
 
+struct socket_node
+{
+    socket s;
+    socket_node *next = nullptr;
+};
+
 struct socket_thread_private
 {
     std::thread thread;
-    std::mutex mutex;
-    std::condition_variable cv;
-    std::vector<socket> batch;
+    // New connections, pushed by any thread without locks (Treiber stack).
+    std::atomic<socket_node *> pending{ nullptr };
+    int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    // Declared before the clients, sockets must be destroyed first.
+    timer_wheel wheel;
+    socket_deadlines deadlines;
+    // Owned by the worker thread only.
+    sockets clients;
     std::atomic_bool stop{ false };
     std::function<void(sockets &)> callback;
-    std::chrono::steady_clock::time_point time;
 
     ~socket_thread_private();
     void wait();
     void terminate();
+    void notify();
     void push(socket &&s);
-    void push(sockets &s);
+    bool adopt();
     void run();
 };
 
 socket_thread_private::~socket_thread_private()
 {
     wait();
+
+    auto n = pending.exchange(nullptr);
+    while (n) {
+        auto next = n->next;
+        delete n;
+        n = next;
+    }
+
+    if (event_fd >= 0)
+        close(event_fd);
 }
 
 void socket_thread_private::wait()
@@ -46,26 +71,48 @@ void socket_thread_private::wait()
 void socket_thread_private::terminate()
 {
     stop = true;
-    cv.notify_one();
+    notify();
+}
+
+void socket_thread_private::notify()
+{
+    uint64_t one = 1;
+    if (::write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd");
 }
 
 void socket_thread_private::push(socket &&s)
 {
-    mutex.lock();
-    batch.push_back(std::move(s));
-    mutex.unlock();
-    cv.notify_one();
+    auto n = new socket_node{ std::move(s) };
+    n->next = pending.load(std::memory_order_relaxed);
+    while (!pending.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed));
+    notify();
 }
 
-void socket_thread_private::push(sockets &s)
+// Moves new connections to the clients, in the order they were pushed.
+bool socket_thread_private::adopt()
 {
-    mutex.lock();
-    for (socket &a: s) {
-        if (a)
-            batch.push_back(std::move(a));
+    auto n = pending.exchange(nullptr, std::memory_order_acquire);
+    if (!n)
+        return false;
+
+    socket_node *reversed = nullptr;
+    while (n) {
+        auto next = n->next;
+        n->next = reversed;
+        reversed = n;
+        n = next;
     }
-    mutex.unlock();
-    cv.notify_one();
+
+    for (n = reversed; n; ) {
+        n->s.watch(wheel, deadlines);
+        clients.push_back(std::move(n->s));
+        auto next = n->next;
+        delete n;
+        n = next;
+    }
+
+    return true;
 }
 
 socket_thread::socket_thread()
@@ -91,6 +138,11 @@ void socket_thread::push(socket &&s)
     m->push(std::move(s));
 }
 
+void socket_thread::set_deadlines(const socket_deadlines &deadlines)
+{
+    m->deadlines = deadlines;
+}
+
 void socket_thread::start(const std::function<void(sockets &)> &f)
 {
     m->stop = false;
@@ -101,16 +153,23 @@ void socket_thread::start(const std::function<void(sockets &)> &f)
 void socket_thread_private::run()
 {
     while (!stop) {
-        std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock, [&] { return stop || !batch.empty(); });
-        if (stop)
-            break;
-
-        auto b = std::move(batch);
-        lock.unlock();
-
-        callback(b);
-        push(b);
+        adopt();
+        if (clients.empty()) {
+            // Sleeps till a connection is pushed or the thread is stopped.
+            struct pollfd pfd = { event_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                break;
+
+            uint64_t count = 0;
+            if (::read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                break;
+            continue;
+        }
+
+        wheel.advance();
+        callback(clients);
+        clients.erase(std::remove_if(clients.begin(), clients.end(),
+            [](const socket &s) { return !s; }), clients.end());
     }
 }
 
@@ -119,4 +178,9 @@ void socket_thread::stop()
     m->terminate();
 }
 
-} // Capture
\ No newline at end of file
+std::chrono::steady_clock::time_point socket_thread::next_deadline() const
+{
+    return m->wheel.next_expiry();
+}
+
+} // Capture
@@ -0,0 +1,174 @@
+/**
+ * Copyright (C) 2020, Val Doroshchuk <valbok@gmail.com>
+ */
+
+#include "Capture/timer_wheel.h"
+
+#include <algorithm>
+
+namespace Capture {
+
+timer_wheel::timer::~timer()
+{
+    unlink();
+}
+
+void timer_wheel::timer::unlink()
+{
+    if (!next)
+        return;
+
+    prev->next = next;
+    next->prev = prev;
+    prev = next = nullptr;
+    if (wheel)
+        --wheel->count;
+    wheel = nullptr;
+}
+
+timer_wheel::timer_wheel(std::chrono::milliseconds r)
+    : start(clock::now())
+    , resolution(r.count() > 0 ? r : std::chrono::milliseconds(1))
+{
+    for (auto &level : wheel) {
+        for (auto &head : level)
+            head.prev = head.next = &head;
+    }
+}
+
+timer_wheel::~timer_wheel()
+{
+    for (auto &level : wheel) {
+        for (auto &head : level) {
+            while (head.next != &head)
+                head.next->unlink();
+            head.prev = head.next = nullptr;
+        }
+    }
+}
+
+uint64_t timer_wheel::ticks(clock::time_point t) const
+{
+    if (t <= start)
+        return 0;
+    return uint64_t((t - start) / resolution);
+}
+
+void timer_wheel::add(timer &t)
+{
+    uint64_t delta = t.expires - current;
+    timer *head = nullptr;
+    if (int64_t(delta) < 0) {
+        // Already expired, fires on next tick.
+        head = &wheel[0][current & (slots - 1)];
+    } else {
+        unsigned level = 0;
+        while (level < levels - 1 && delta >= (uint64_t(1) << (bits * (level + 1))))
+            ++level;
+        if (delta >= (uint64_t(1) << (bits * levels))) {
+            t.expires = current + (uint64_t(1) << (bits * levels)) - 1;
+            level = levels - 1;
+        }
+        head = &wheel[level][(t.expires >> (bits * level)) & (slots - 1)];
+    }
+
+    t.prev = head->prev;
+    t.next = head;
+    head->prev->next = &t;
+    head->prev = &t;
+    t.wheel = this;
+    ++count;
+}
+
+void timer_wheel::schedule(timer &t, clock::time_point when)
+{
+    t.unlink();
+    t.expires = ticks(when);
+    add(t);
+}
+
+void timer_wheel::cancel(timer &t)
+{
+    t.unlink();
+}
+
+unsigned timer_wheel::cascade(unsigned level, unsigned index)
+{
+    auto &head = wheel[level][index];
+    while (head.next != &head) {
+        auto t = head.next;
+        t->unlink();
+        add(*t);
+    }
+
+    return index;
+}
+
+size_t timer_wheel::advance(clock::time_point now)
+{
+    uint64_t target = ticks(now);
+    if (!count && current <= target)
+        current = target;
+
+    size_t fired = 0;
+    while (current <= target) {
+        unsigned index = current & (slots - 1);
+        for (unsigned level = 1; !index && level < levels; ++level)
+            index = cascade(level, (current >> (bits * level)) & (slots - 1));
+
+        auto &head = wheel[0][current & (slots - 1)];
+        ++current;
+        if (head.next == &head)
+            continue;
+
+        // Callbacks are allowed to reschedule or cancel any timer,
+        // the slot is detached first to not fire rescheduled ones again.
+        timer pending;
+        pending.next = head.next;
+        pending.prev = head.prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head.prev = head.next = &head;
+
+        while (pending.next != &pending) {
+            auto t = pending.next;
+            t->unlink();
+            ++fired;
+            if (t->expired)
+                t->expired();
+        }
+        pending.prev = pending.next = nullptr;
+    }
+
+    return fired;
+}
+
+size_t timer_wheel::size() const
+{
+    return count;
+}
+
+timer_wheel::clock::time_point timer_wheel::next_expiry() const
+{
+    if (!count)
+        return clock::time_point::max();
+
+    // Exact for the first level, the cascade of a slot for upper ones.
+    // Once the current slot of an upper level is cascaded, its timers are a full turn ahead.
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < levels; ++level) {
+        uint64_t slot = current >> (bits * level);
+        bool cascaded = current & ((uint64_t(1) << (bits * level)) - 1);
+        for (unsigned i = cascaded ? 1 : 0; i <= slots; ++i) {
+            auto &head = wheel[level][(slot + i) & (slots - 1)];
+            if (head.next != &head) {
+                next = std::min(next, std::max((slot + i) << (bits * level), current));
+                break;
+            }
+        }
+    }
+
+    return start + resolution * next;
+}
+
+} // Capture
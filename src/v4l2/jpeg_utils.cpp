@@ -4,6 +4,7 @@
 
 #include "jpeg_utils.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <jpeglib.h>
@@ -124,4 +125,97 @@ int jpeg_data(unsigned pixel_format, unsigned char *input, size_t width, size_t
     return output_size;
 }
 
+int jpeg_semi_planar_data(unsigned pixel_format, const unsigned char *luma, size_t luma_stride, const unsigned char *chroma,
+    size_t chroma_stride, size_t width, size_t height, unsigned char *&output, int quality)
+{
+    output = NULL;
+    if (!width || !height)
+        return 0;
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint64_t output_size = 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &output, &output_size);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    // Samples are passed as they are: no colour conversion and no downsampling, 4:2:0 or 4:2:2.
+    bool half_lines = pixel_format == V4L2_PIX_FMT_NV12 || pixel_format == V4L2_PIX_FMT_NV12M;
+    cinfo.raw_data_in = TRUE;
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = half_lines ? 2 : 1;
+    for (int c = 1; c < 3; ++c) {
+        cinfo.comp_info[c].h_samp_factor = 1;
+        cinfo.comp_info[c].v_samp_factor = 1;
+    }
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // Rows of a call are padded to whole MCUs, 16 pixels wide, by the last sample.
+    const size_t luma_width = (width + 15) / 16 * 16;
+    const size_t chroma_width = luma_width / 2;
+    const size_t luma_rows = cinfo.comp_info[0].v_samp_factor * DCTSIZE;
+    const size_t chroma_height = half_lines ? (height + 1) / 2 : height;
+    // Luma lines are read in place if no padding column has to repeat the last pixel.
+    const bool in_place = width == luma_width;
+    std::vector<uint8_t> luma_buffer(in_place ? 0 : luma_width * luma_rows);
+    std::vector<uint8_t> cb_buffer(chroma_width * DCTSIZE);
+    std::vector<uint8_t> cr_buffer(chroma_width * DCTSIZE);
+    JSAMPROW y_rows[2 * DCTSIZE];
+    JSAMPROW cb_rows[DCTSIZE];
+    JSAMPROW cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        size_t top = cinfo.next_scanline;
+        for (size_t i = 0; i < luma_rows; ++i) {
+            // Lines below the image repeat the last one.
+            auto line = luma + std::min(top + i, height - 1) * luma_stride;
+            if (in_place) {
+                y_rows[i] = (JSAMPROW)line;
+                continue;
+            }
+
+            auto dst = luma_buffer.data() + i * luma_width;
+            memcpy(dst, line, width);
+            memset(dst + width, line[width - 1], luma_width - width);
+            y_rows[i] = dst;
+        }
+
+        // Interleaved Cb and Cr are split.
+        size_t chroma_top = half_lines ? top / 2 : top;
+        for (size_t i = 0; i < DCTSIZE; ++i) {
+            auto line = chroma + std::min(chroma_top + i, chroma_height - 1) * chroma_stride;
+            auto cb = cb_buffer.data() + i * chroma_width;
+            auto cr = cr_buffer.data() + i * chroma_width;
+            size_t x = 0;
+            for (; x < (width + 1) / 2; ++x) {
+                cb[x] = line[2 * x];
+                cr[x] = line[2 * x + 1];
+            }
+            for (; x < chroma_width; ++x) {
+                cb[x] = cb[x - 1];
+                cr[x] = cr[x - 1];
+            }
+            cb_rows[i] = cb;
+            cr_rows[i] = cr;
+        }
+
+        jpeg_write_raw_data(&cinfo, planes, luma_rows);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return output_size;
+}
+
 } // Capture
\ No newline at end of file
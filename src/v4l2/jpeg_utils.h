@@ -11,6 +11,10 @@ namespace Capture {
 
 int jpeg_data(unsigned pixel_format, unsigned char *input, size_t width, size_t height, unsigned char *&output, int quality = 92);
 
+// NV12 or NV16 (and their multi-planar variants) are encoded from the luma and chroma planes as they are.
+int jpeg_semi_planar_data(unsigned pixel_format, const unsigned char *luma, size_t luma_stride, const unsigned char *chroma,
+    size_t chroma_stride, size_t width, size_t height, unsigned char *&output, int quality = 92);
+
 }
 
 #endif
@@ -12,15 +12,60 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <linux/videodev2.h>
 
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
-struct Buffer {
+struct Plane {
     void *start;
     size_t length;
+    // Exported by VIDIOC_EXPBUF, -1 if not.
+    int dmabuf;
+    // Data of the latest dequeued frame.
+    size_t offset;
+    size_t used;
+};
+
+struct Buffer {
+    Plane planes[VIDEO_MAX_PLANES];
+    // When it was queued to the driver, CLOCK_MONOTONIC in microseconds.
+    int64_t queued;
+};
+
+// Buffers of a started device.
+struct Queue {
+    int fd = -1;
+    unsigned type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned memory = V4L2_MEMORY_MMAP;
+    // Memory planes of a buffer, more than one only for multi-planar formats, e.g. NV12M.
+    unsigned planes = 1;
+    Buffer *buffers = nullptr;
+    unsigned count = 0;
+
+    bool mplane() const { return type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE; }
+};
+
+// Accounting of dequeued buffers.
+struct Counters {
+    Capture::v4l2_stats stats;
+    // Sequence of the previous buffer, -1 before the first one.
+    int64_t sequence = -1;
+    // Monotonic capture time of the previous buffer in microseconds, -1 if unknown.
+    int64_t timestamp = -1;
 };
 
+static int64_t monotonic_usec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
 static void print_errno(const char *s)
 {
     fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
@@ -68,6 +113,38 @@ static void close_device(int &fd)
     fd = -1;
 }
 
+// Luma and interleaved chroma planes, chroma of every other column. NV12 has chroma of every other line.
+static bool is_semi_planar(unsigned format)
+{
+    switch (format) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV16M:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Single-planar capture if the device supports it, multi-planar otherwise, 0 if it does not capture.
+static unsigned capture_type(const struct v4l2_capability &cap)
+{
+    unsigned caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+    if (caps & V4L2_CAP_VIDEO_CAPTURE)
+        return V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
+        return V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    return 0;
+}
+
+static unsigned capture_type(int fd)
+{
+    struct v4l2_capability cap;
+    CLEAR(cap);
+    return xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1 ? 0 : capture_type(cap);
+}
+
 static bool init_device(int fd, const std::string &dev, unsigned w, unsigned h, unsigned pixel_format, v4l2_format *fmt)
 {
     struct v4l2_capability cap;
@@ -82,7 +159,8 @@ static bool init_device(int fd, const std::string &dev, unsigned w, unsigned h,
         return false;
     }
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+    unsigned type = capture_type(cap);
+    if (!type) {
         fprintf(stderr, "%s is no video capture device\n", dev.c_str());
         return false;
     }
@@ -95,9 +173,9 @@ static bool init_device(int fd, const std::string &dev, unsigned w, unsigned h,
     /* Select video input, video standard and tune here. */
     CLEAR(cropcap);
 
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cropcap.type = type;
     if (xioctl(fd, VIDIOC_CROPCAP, &cropcap) == 0) {
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.type = type;
         crop.c = cropcap.defrect; /* reset to default */
 
         if (xioctl(fd, VIDIOC_S_CROP, &crop) == -1) {
@@ -116,7 +194,29 @@ static bool init_device(int fd, const std::string &dev, unsigned w, unsigned h,
 
     CLEAR(*fmt);
 
-    fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt->type = type;
+    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        // Planes are described by the driver.
+        fmt->fmt.pix_mp.pixelformat = pixel_format ? pixel_format : V4L2_PIX_FMT_MJPEG;
+        fmt->fmt.pix_mp.field = V4L2_FIELD_ANY;
+        if (w || h) {
+            fmt->fmt.pix_mp.width = w;
+            fmt->fmt.pix_mp.height = h;
+        }
+
+        if (xioctl(fd, VIDIOC_S_FMT, fmt) == -1) {
+            print_errno("VIDIOC_S_FMT");
+            return false;
+        }
+
+        if (!fmt->fmt.pix_mp.num_planes || fmt->fmt.pix_mp.num_planes > VIDEO_MAX_PLANES) {
+            fprintf(stderr, "%s reports %u planes\n", dev.c_str(), fmt->fmt.pix_mp.num_planes);
+            return false;
+        }
+
+        return true;
+    }
+
     fmt->fmt.pix.pixelformat = pixel_format ? pixel_format : V4L2_PIX_FMT_MJPEG;
     fmt->fmt.pix.field = V4L2_FIELD_ANY;
     if (w || h) {
@@ -130,109 +230,405 @@ static bool init_device(int fd, const std::string &dev, unsigned w, unsigned h,
     }
 
     /* Buggy driver paranoia. */
-    unsigned min = fmt->fmt.pix.width * 2;
+    bool semi_planar = is_semi_planar(fmt->fmt.pix.pixelformat);
+    unsigned min = fmt->fmt.pix.width * (semi_planar ? 1 : 2);
     if (fmt->fmt.pix.bytesperline < min)
         fmt->fmt.pix.bytesperline = min;
-    min = fmt->fmt.pix.bytesperline * fmt->fmt.pix.height;
+    unsigned lines = fmt->fmt.pix.height;
+    if (semi_planar)
+        lines += fmt->fmt.pix.pixelformat == V4L2_PIX_FMT_NV12 ? (lines + 1) / 2 : lines;
+    min = fmt->fmt.pix.bytesperline * lines;
     if (fmt->fmt.pix.sizeimage < min)
         fmt->fmt.pix.sizeimage = min;
 
     return true;
 }
 
-static void uninit_device(void **buffers, unsigned &n_buffers)
+static void add_intervals(int fd, unsigned format, unsigned w, unsigned h, unsigned fps, std::vector<Capture::v4l2_mode> &modes)
+{
+    Capture::v4l2_mode mode;
+    mode.pixel_format = format;
+    mode.width = w;
+    mode.height = h;
+
+    struct v4l2_frmivalenum ival;
+    CLEAR(ival);
+    ival.pixel_format = format;
+    ival.width = w;
+    ival.height = h;
+    if (xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == -1) {
+        // Rate is not known.
+        modes.push_back(mode);
+        return;
+    }
+
+    if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+        // The fastest rate and the requested one if it is in the range.
+        auto &sw = ival.stepwise;
+        mode.interval_numerator = sw.min.numerator;
+        mode.interval_denominator = sw.min.denominator;
+        modes.push_back(mode);
+        double fastest = sw.min.numerator ? double(sw.min.denominator) / sw.min.numerator : 0;
+        double slowest = sw.max.numerator ? double(sw.max.denominator) / sw.max.numerator : 0;
+        if (fps && fps < fastest && fps >= slowest) {
+            mode.interval_numerator = 1;
+            mode.interval_denominator = fps;
+            modes.push_back(mode);
+        }
+        return;
+    }
+
+    do {
+        mode.interval_numerator = ival.discrete.numerator;
+        mode.interval_denominator = ival.discrete.denominator;
+        modes.push_back(mode);
+        ++ival.index;
+    } while (xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0);
+}
+
+// Formats, sizes and rates of the device. Stepwise sizes are reported by the largest one and the requested one.
+static std::vector<Capture::v4l2_mode> enum_modes(int fd, unsigned w, unsigned h, unsigned fps)
+{
+    std::vector<Capture::v4l2_mode> modes;
+    struct v4l2_fmtdesc desc;
+    CLEAR(desc);
+    desc.type = capture_type(fd);
+    for (; desc.type && xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; ++desc.index) {
+        struct v4l2_frmsizeenum size;
+        CLEAR(size);
+        size.pixel_format = desc.pixelformat;
+        if (xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == -1)
+            continue;
+
+        if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+            auto &sw = size.stepwise;
+            add_intervals(fd, desc.pixelformat, sw.max_width, sw.max_height, fps, modes);
+            if (w && h && w >= sw.min_width && w < sw.max_width && h >= sw.min_height && h < sw.max_height) {
+                // Aligned up to the step.
+                unsigned sw_w = sw.min_width + (w - sw.min_width + sw.step_width - 1) / std::max(1u, sw.step_width) * sw.step_width;
+                unsigned sw_h = sw.min_height + (h - sw.min_height + sw.step_height - 1) / std::max(1u, sw.step_height) * sw.step_height;
+                add_intervals(fd, desc.pixelformat, std::min(sw_w, sw.max_width), std::min(sw_h, sw.max_height), fps, modes);
+            }
+            continue;
+        }
+
+        do {
+            add_intervals(fd, desc.pixelformat, size.discrete.width, size.discrete.height, fps, modes);
+            ++size.index;
+        } while (xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0);
+    }
+
+    return modes;
+}
+
+// Relative CPU cost of a pixel of a format to get a jpeg: copied or encoded, 0 if it could not be converted.
+static double pixel_cost(unsigned format)
 {
-    auto buf = (Buffer *)*buffers;
-    if (!buf)
+    switch (format) {
+    case V4L2_PIX_FMT_MJPEG:
+        return 1;
+    // Encoded from the samples as they are, without conversion to RGB and back.
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV16M:
+        return 6;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_RGB565:
+        return 10;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Prefers modes that cover the size, then that reach the rate, then the lowest cost: pixels per second
+ * by the cost of a pixel. So a larger Motion-JPEG mode could win over encoding of a smaller raw one.
+ */
+static bool choose_mode(const std::vector<Capture::v4l2_mode> &modes, unsigned w, unsigned h, unsigned fps,
+    unsigned pixel_format, Capture::v4l2_mode &chosen)
+{
+    auto key = [&](const Capture::v4l2_mode &m) {
+        double area = double(m.width) * m.height;
+        bool size_ok = (!w || m.width >= w) && (!h || m.height >= h);
+        // 29.97 is 30.
+        bool fps_ok = !fps || m.fps() + 0.5 >= fps;
+        double rate = m.fps() ? m.fps() : 30;
+        // Without a requested rate the fastest one is taken.
+        double cost = area * (fps ? rate : 1) * (pixel_format ? 1 : pixel_cost(m.pixel_format));
+        return std::make_tuple(!size_ok, !fps_ok, size_ok ? 0 : -area, fps_ok ? 0 : -rate, cost, area, -rate);
+    };
+
+    bool found = false;
+    for (auto &m : modes) {
+        if (pixel_format ? m.pixel_format != pixel_format : !pixel_cost(m.pixel_format))
+            continue;
+        if (!found || key(m) < key(chosen)) {
+            chosen = m;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+// Sets the rate of the mode if the driver supports it, the actual one is read back.
+static void set_frame_interval(int fd, unsigned type, Capture::v4l2_mode &mode)
+{
+    struct v4l2_streamparm parm;
+    CLEAR(parm);
+    parm.type = type;
+    if (xioctl(fd, VIDIOC_G_PARM, &parm) == -1 || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
         return;
 
-    for (unsigned i = 0; i < n_buffers; ++i) {
-        if (munmap(buf[i].start, buf[i].length) == -1)
-            print_errno("munmap");
+    if (mode.interval_numerator && mode.interval_denominator) {
+        parm.parm.capture.timeperframe.numerator = mode.interval_numerator;
+        parm.parm.capture.timeperframe.denominator = mode.interval_denominator;
+        if (xioctl(fd, VIDIOC_S_PARM, &parm) == -1)
+            print_errno("VIDIOC_S_PARM");
     }
 
-    free(buf);
-    *buffers = nullptr;
-    n_buffers = 0;
+    mode.interval_numerator = parm.parm.capture.timeperframe.numerator;
+    mode.interval_denominator = parm.parm.capture.timeperframe.denominator;
 }
 
-static void *init_mmap(int fd, const std::string &dev, unsigned buffers_count)
+static Buffer *alloc_buffers(unsigned count)
+{
+    auto buffers = (Buffer *)calloc(count, sizeof(Buffer));
+    if (!buffers) {
+        fprintf(stderr, "Out of memory\n");
+        return nullptr;
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        for (auto &plane : buffers[i].planes)
+            plane.dmabuf = -1;
+    }
+
+    return buffers;
+}
+
+static void uninit_device(Queue &q)
+{
+    if (!q.buffers)
+        return;
+
+    for (unsigned i = 0; i < q.count; ++i) {
+        for (unsigned p = 0; p < q.planes; ++p) {
+            auto &plane = q.buffers[i].planes[p];
+            if (plane.dmabuf >= 0)
+                close(plane.dmabuf);
+            if (plane.start && munmap(plane.start, plane.length) == -1)
+                print_errno("munmap");
+        }
+    }
+
+    free(q.buffers);
+    q.buffers = nullptr;
+    q.count = 0;
+}
+
+// Planes of a multi-planar buffer are described by the array.
+static void prepare_buffer(const Queue &q, struct v4l2_buffer &buf, struct v4l2_plane *planes, unsigned index)
+{
+    CLEAR(buf);
+    buf.type = q.type;
+    buf.memory = q.memory;
+    buf.index = index;
+    if (q.mplane()) {
+        memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+        buf.m.planes = planes;
+        buf.length = q.planes;
+    }
+}
+
+static bool request_buffers(Queue &q, const std::string &dev, unsigned &buffers_count)
 {
     struct v4l2_requestbuffers req;
     CLEAR(req);
     req.count = buffers_count;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    req.type = q.type;
+    req.memory = q.memory;
 
-    if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+    if (xioctl(q.fd, VIDIOC_REQBUFS, &req) == -1) {
         if (EINVAL == errno)
-            fprintf(stderr, "%s does not support memory mapping\n", dev.c_str());
+            fprintf(stderr, "%s does not support %s\n", dev.c_str(),
+                q.memory == V4L2_MEMORY_MMAP ? "memory mapping" : "user pointer i/o");
         else
             print_errno("VIDIOC_REQBUFS");
-        return nullptr;
+        return false;
     }
 
     if (req.count < 2) {
         fprintf(stderr, "Insufficient buffer memory on %s\n", dev.c_str());
-        return nullptr;
+        return false;
     }
 
-    auto buffers = (Buffer *)calloc(req.count, sizeof(Buffer));
-    if (!buffers) {
-        fprintf(stderr, "Out of memory\n");
-        return nullptr;
-    }
+    buffers_count = req.count;
+    return true;
+}
+
+static bool init_mmap(Queue &q, const std::string &dev, unsigned buffers_count)
+{
+    q.memory = V4L2_MEMORY_MMAP;
+    if (!request_buffers(q, dev, buffers_count))
+        return false;
+
+    q.buffers = alloc_buffers(buffers_count);
+    if (!q.buffers)
+        return false;
 
     for (unsigned i = 0; i < buffers_count; ++i) {
         struct v4l2_buffer buf;
-        CLEAR(buf);
-
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        prepare_buffer(q, buf, planes, i);
 
-        if (xioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+        q.count = i + 1;
+        if (xioctl(q.fd, VIDIOC_QUERYBUF, &buf) == -1) {
             print_errno("VIDIOC_QUERYBUF");
-            uninit_device((void **)&buffers, i);
-            return nullptr;
+            uninit_device(q);
+            return false;
         }
 
-        buffers[i].length = buf.length;
-        buffers[i].start =
-            mmap(NULL /* start anywhere */,
-                 buf.length,
-                 PROT_READ | PROT_WRITE /* required */,
-                 MAP_SHARED /* recommended */,
-                 fd, buf.m.offset);
-
-        if (buffers[i].start == MAP_FAILED) {
-            print_errno("mmap");
-            uninit_device((void **)&buffers, i);
-            return nullptr;
+        for (unsigned p = 0; p < q.planes; ++p) {
+            size_t length = q.mplane() ? planes[p].length : buf.length;
+            off_t offset = q.mplane() ? planes[p].m.mem_offset : buf.m.offset;
+            void *start =
+                mmap(NULL /* start anywhere */,
+                     length,
+                     PROT_READ | PROT_WRITE /* required */,
+                     MAP_SHARED /* recommended */,
+                     q.fd, offset);
+
+            if (start == MAP_FAILED) {
+                print_errno("mmap");
+                uninit_device(q);
+                return false;
+            }
+
+            q.buffers[i].planes[p].start = start;
+            q.buffers[i].planes[p].length = length;
         }
     }
 
-    return buffers;
+    return true;
 }
 
-static bool start_capturing(int fd, unsigned n_buffers)
+// Anonymous memory of the application, rounded up to pages.
+static void *alloc_user_buffer(size_t &length, bool hugepages)
 {
-    for (unsigned i = 0; i < n_buffers; ++i) {
-        struct v4l2_buffer buf;
+    const size_t huge_page = 2 * 1024 * 1024;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t align = hugepages ? huge_page : size_t(page > 0 ? page : 4096);
+    length = (length + align - 1) / align * align;
+
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    // Reserved hugepages first, transparent ones otherwise.
+    if (hugepages)
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        print_errno("mmap");
+        return nullptr;
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugepages)
+        madvise(p, length, MADV_HUGEPAGE);
+#endif
 
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
+    return p;
+}
 
-        if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
-            print_errno("VIDIOC_QBUF");
-            return false;
+// Buffers of the application, a plane is of the size reported by the format.
+static bool init_userptr(Queue &q, const std::string &dev, unsigned buffers_count, const size_t *plane_sizes, bool hugepages)
+{
+    q.memory = V4L2_MEMORY_USERPTR;
+    if (!request_buffers(q, dev, buffers_count))
+        return false;
+
+    q.buffers = alloc_buffers(buffers_count);
+    if (!q.buffers)
+        return false;
+
+    for (unsigned i = 0; i < buffers_count; ++i) {
+        q.count = i + 1;
+        for (unsigned p = 0; p < q.planes; ++p) {
+            auto &plane = q.buffers[i].planes[p];
+            plane.length = plane_sizes[p];
+            plane.start = alloc_user_buffer(plane.length, hugepages);
+            if (!plane.start) {
+                uninit_device(q);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Every plane of every buffer is exported as a DMABUF fd to be passed to other processes or devices.
+static bool export_buffers(Queue &q)
+{
+    for (unsigned i = 0; i < q.count; ++i) {
+        for (unsigned p = 0; p < q.planes; ++p) {
+            struct v4l2_exportbuffer expbuf;
+            CLEAR(expbuf);
+            expbuf.type = q.type;
+            expbuf.index = i;
+            expbuf.plane = p;
+            expbuf.flags = O_RDONLY | O_CLOEXEC;
+            if (xioctl(q.fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+                print_errno("VIDIOC_EXPBUF");
+                return false;
+            }
+
+            q.buffers[i].planes[p].dmabuf = expbuf.fd;
+        }
+    }
+
+    return true;
+}
+
+static bool queue_buffer(const Queue &q, unsigned index)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    prepare_buffer(q, buf, planes, index);
+    if (q.memory == V4L2_MEMORY_USERPTR) {
+        auto &b = q.buffers[index];
+        if (q.mplane()) {
+            for (unsigned p = 0; p < q.planes; ++p) {
+                planes[p].m.userptr = (unsigned long)b.planes[p].start;
+                planes[p].length = b.planes[p].length;
+            }
+        } else {
+            buf.m.userptr = (unsigned long)b.planes[0].start;
+            buf.length = b.planes[0].length;
         }
     }
 
-    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
+    if (xioctl(q.fd, VIDIOC_QBUF, &buf) == -1) {
+        print_errno("VIDIOC_QBUF");
+        return false;
+    }
+
+    q.buffers[index].queued = monotonic_usec();
+    return true;
+}
+
+static bool start_capturing(const Queue &q)
+{
+    for (unsigned i = 0; i < q.count; ++i) {
+        if (!queue_buffer(q, i))
+            return false;
+    }
+
+    enum v4l2_buf_type type = v4l2_buf_type(q.type);
+    if (xioctl(q.fd, VIDIOC_STREAMON, &type) == -1) {
         print_errno("VIDIOC_STREAMON");
         return false;
     }
@@ -240,61 +636,149 @@ static bool start_capturing(int fd, unsigned n_buffers)
     return true;
 }
 
-static void stop_capturing(int fd)
+static void stop_capturing(const Queue &q)
 {
-    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (fd != -1 && xioctl(fd, VIDIOC_STREAMOFF, &type) == -1)
+    enum v4l2_buf_type type = v4l2_buf_type(q.type);
+    if (q.fd != -1 && xioctl(q.fd, VIDIOC_STREAMOFF, &type) == -1)
         print_errno("VIDIOC_STREAMOFF");
 }
 
-static struct v4l2_buffer read_frame(int fd)
+// Bytes used by planes are kept by the buffer, buf.bytesused is of all planes.
+static bool dequeue_buffer(const Queue &q, struct v4l2_buffer &buf)
 {
-    struct v4l2_buffer buf;
-    CLEAR(buf);
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-
-    if (xioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
-        CLEAR(buf);
-        switch (errno) {
-        case EAGAIN:
-            return buf;
-        case EIO:
-            /* Could ignore EIO, see spec. */
-            /* fall through */
-        default:
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    prepare_buffer(q, buf, planes, 0);
+    if (xioctl(q.fd, VIDIOC_DQBUF, &buf) == -1) {
+        if (errno != EAGAIN)
             print_errno("VIDIOC_DQBUF");
-            return buf;
+        return false;
+    }
+
+    auto &b = q.buffers[buf.index];
+    if (!q.mplane()) {
+        b.planes[0].offset = 0;
+        b.planes[0].used = buf.bytesused;
+        return true;
+    }
+
+    buf.bytesused = 0;
+    for (unsigned p = 0; p < q.planes; ++p) {
+        b.planes[p].offset = std::min(planes[p].data_offset, planes[p].bytesused);
+        b.planes[p].used = planes[p].bytesused - b.planes[p].offset;
+        buf.bytesused += b.planes[p].used;
+    }
+    // The array does not outlive the call.
+    buf.m.planes = nullptr;
+    buf.length = 0;
+    return true;
+}
+
+// The driver numbers every frame it captures, also those it had no free buffer for.
+// Buffers are filled in the order they are queued, if the one after a gap was queued only after the previous capture,
+// the driver had none free in between: the application did not read.
+static void count_buffer(const Queue &q, Counters &c, const struct v4l2_buffer &buf)
+{
+    bool monotonic = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if (c.sequence >= 0 && buf.sequence > c.sequence + 1) {
+        size_t gap = buf.sequence - c.sequence - 1;
+        if (monotonic && c.timestamp >= 0 && q.buffers[buf.index].queued > c.timestamp)
+            c.stats.overrun += gap;
+        else
+            c.stats.lost += gap;
+    }
+    c.sequence = buf.sequence;
+    c.timestamp = monotonic ? buf.timestamp.tv_sec * 1000000LL + buf.timestamp.tv_usec : -1;
+    if (buf.flags & V4L2_BUF_FLAG_ERROR)
+        ++c.stats.errors;
+}
+
+// Time since the capture, only monotonic timestamps are of the same clock.
+static void count_latency(Counters &c, const struct v4l2_buffer &buf)
+{
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    std::chrono::microseconds latency((now.tv_sec - buf.timestamp.tv_sec) * 1000000LL
+        + now.tv_nsec / 1000 - buf.timestamp.tv_usec);
+    if (latency.count() < 0)
+        return;
+
+    auto &stats = c.stats;
+    ++stats.latency_count;
+    stats.latency_sum += latency;
+    stats.latency_max = std::max(stats.latency_max, latency);
+}
+
+// Dequeues all ready buffers and requeues all but the newest one, which is kept by the caller.
+static struct v4l2_buffer read_latest_frame(const Queue &q, Counters &c)
+{
+    struct v4l2_buffer latest;
+    CLEAR(latest);
+    struct v4l2_buffer buf;
+    while (dequeue_buffer(q, buf)) {
+        count_buffer(q, c, buf);
+        if (!buf.bytesused) {
+            queue_buffer(q, buf.index);
+            continue;
+        }
+        if (latest.bytesused) {
+            ++c.stats.skipped;
+            queue_buffer(q, latest.index);
         }
+        latest = buf;
     }
 
-    auto r = buf;
+    return latest;
+}
 
-    if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+static struct v4l2_buffer read_frame(const Queue &q, Counters &c)
+{
+    struct v4l2_buffer buf;
+    if (!dequeue_buffer(q, buf)) {
         CLEAR(buf);
-        print_errno("VIDIOC_QBUF");
         return buf;
     }
 
-    return r;
+    count_buffer(q, c, buf);
+    if (!queue_buffer(q, buf.index))
+        CLEAR(buf);
+
+    return buf;
 }
 
 namespace Capture {
 
+struct v4l2_frame_plane
+{
+    unsigned char *data = nullptr;
+    size_t size = 0;
+    size_t stride = 0;
+};
+
 struct v4l2_frame_private
 {
     size_t width = 0;
     size_t height = 0;
     unsigned pixel_format = 0;
+    // The first plane, size of all planes.
     unsigned char *data = nullptr;
     size_t size = 0;
+    v4l2_frame_plane planes[VIDEO_MAX_PLANES];
+    size_t planes_count = 0;
     struct timeval timestamp = { 0, 0 };
+    unsigned sequence = 0;
+    unsigned flags = 0;
+    int dmabuf = -1;
     bool detached = false;
 
     ~v4l2_frame_private();
     void release();
     v4l2_frame_private &operator=(const v4l2_frame_private &other);
     void detach();
+    void set_data(unsigned char *d, size_t s, size_t stride);
+    void set_planes(const Buffer &buffer, const Queue &q, const v4l2_plane_pix_format *formats);
 };
 
 v4l2_frame_private::~v4l2_frame_private()
@@ -318,24 +802,70 @@ v4l2_frame_private &v4l2_frame_private::operator=(const v4l2_frame_private &othe
     pixel_format = other.pixel_format;
     data = other.data;
     size = other.size;
+    std::copy(other.planes, other.planes + other.planes_count, planes);
+    planes_count = other.planes_count;
     timestamp = other.timestamp;
+    sequence = other.sequence;
+    flags = other.flags;
+    // A copy does not refer to the buffer of the device.
+    dmabuf = -1;
 
     detach();
     return *this;
 }
 
+// Planes are copied one after another.
 void v4l2_frame_private::detach()
 {
     if (!size)
         return;
 
     auto dst = new unsigned char[size];
-    auto d = (unsigned char *)data;
-    std::copy(d, d + size, dst);
+    auto p = dst;
+    for (size_t i = 0; i < planes_count; ++i) {
+        std::copy(planes[i].data, planes[i].data + planes[i].size, p);
+        planes[i].data = p;
+        p += planes[i].size;
+    }
     data = dst;
     detached = true;
 }
 
+void v4l2_frame_private::set_data(unsigned char *d, size_t s, size_t stride)
+{
+    data = d;
+    size = s;
+    planes[0].data = d;
+    planes[0].size = s;
+    planes[0].stride = stride;
+    planes_count = 1;
+}
+
+void v4l2_frame_private::set_planes(const Buffer &buffer, const Queue &q, const v4l2_plane_pix_format *formats)
+{
+    size = 0;
+    planes_count = q.planes;
+    for (unsigned p = 0; p < q.planes; ++p) {
+        auto &plane = buffer.planes[p];
+        planes[p].data = (unsigned char *)plane.start + plane.offset;
+        planes[p].size = plane.used;
+        planes[p].stride = formats[p].bytesperline;
+        size += plane.used;
+    }
+    data = planes[0].data;
+    dmabuf = buffer.planes[0].dmabuf;
+
+    // One buffer of NV12 or NV16 holds the chroma plane after the luma one.
+    size_t luma = planes[0].stride * height;
+    if (planes_count == 1 && is_semi_planar(pixel_format) && planes[0].size > luma) {
+        planes[1].data = planes[0].data + luma;
+        planes[1].size = planes[0].size - luma;
+        planes[1].stride = planes[0].stride;
+        planes[0].size = luma;
+        planes_count = 2;
+    }
+}
+
 v4l2_frame::v4l2_frame()
     : m(new v4l2_frame_private)
 {
@@ -401,31 +931,90 @@ struct timeval v4l2_frame::timestamp() const
     return m->timestamp;
 }
 
+unsigned v4l2_frame::sequence() const
+{
+    return m->sequence;
+}
+
+unsigned v4l2_frame::flags() const
+{
+    return m->flags;
+}
+
+bool v4l2_frame::monotonic_timestamp() const
+{
+    return (m->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+}
+
+int v4l2_frame::dmabuf_fd() const
+{
+    return m->dmabuf;
+}
+
+size_t v4l2_frame::planes_count() const
+{
+    return m->planes_count;
+}
+
+const void *v4l2_frame::plane_data(size_t plane) const
+{
+    return plane < m->planes_count ? m->planes[plane].data : nullptr;
+}
+
+size_t v4l2_frame::plane_size(size_t plane) const
+{
+    return plane < m->planes_count ? m->planes[plane].size : 0;
+}
+
+size_t v4l2_frame::plane_stride(size_t plane) const
+{
+    return plane < m->planes_count ? m->planes[plane].stride : 0;
+}
+
 v4l2_frame v4l2_frame::convert(unsigned f) const
 {
     v4l2_frame frame;
     if (f != V4L2_PIX_FMT_MJPEG)
         return frame;
 
+    unsigned char *output = nullptr;
+    size_t size = 0;
     switch (m->pixel_format) {
     case V4L2_PIX_FMT_YUYV:
     case V4L2_PIX_FMT_UYVY:
-    case V4L2_PIX_FMT_RGB565: {
-        unsigned char *output = nullptr;
-        frame.m->width = m->width;
-        frame.m->height = m->height;
-        frame.m->pixel_format = V4L2_PIX_FMT_MJPEG;
-        frame.m->timestamp = m->timestamp;
-        frame.m->size = jpeg_data(m->pixel_format, m->data, m->width, m->height, output);
-        frame.m->data = output;
-        frame.m->detach();
-        free(output);
+    case V4L2_PIX_FMT_RGB565:
+        size = jpeg_data(m->pixel_format, m->data, m->width, m->height, output);
+        break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV16M: {
+        // Truncated frames are not encoded.
+        auto &luma = m->planes[0];
+        auto &chroma = m->planes[1];
+        size_t chroma_lines = m->pixel_format == V4L2_PIX_FMT_NV12 || m->pixel_format == V4L2_PIX_FMT_NV12M
+            ? (m->height + 1) / 2 : m->height;
+        if (m->planes_count < 2 || luma.stride < m->width || chroma.stride < (m->width + 1) / 2 * 2
+            || luma.size < luma.stride * m->height || chroma.size < chroma.stride * chroma_lines)
+            return frame;
+
+        size = jpeg_semi_planar_data(m->pixel_format, luma.data, luma.stride, chroma.data, chroma.stride,
+            m->width, m->height, output);
         break;
     }
     default:
-        break;
+        return frame;
     }
 
+    frame.m->width = m->width;
+    frame.m->height = m->height;
+    frame.m->pixel_format = V4L2_PIX_FMT_MJPEG;
+    frame.m->timestamp = m->timestamp;
+    frame.m->sequence = m->sequence;
+    frame.m->flags = m->flags;
+    frame.m->set_data(output, size, 0);
+    frame.m->detach();
+    free(output);
     return frame;
 }
 
@@ -435,9 +1024,19 @@ struct v4l2_private
     std::string device;
     int fd = -1;
     unsigned requested_pixel_format = 0;
+    // A multi-planar format is described as a single plane, sizeimage of all planes.
     v4l2_pix_format fmt;
-    void *buffers = nullptr;
-    unsigned buffers_count = 5;
+    v4l2_plane_pix_format plane_formats[VIDEO_MAX_PLANES];
+    Queue queue;
+    v4l2::memory_type memory = v4l2::memory_mmap;
+    bool dmabuf_export = false;
+    unsigned fps = 0;
+    v4l2_mode mode;
+    bool latest_only = false;
+    v4l2::frame_callback callback;
+    // Buffer of the latest frame, kept dequeued until the next read.
+    int held = -1;
+    Counters counters;
 };
 
 v4l2::v4l2(const std::string &device)
@@ -452,6 +1051,11 @@ v4l2::~v4l2()
     delete m;
 }
 
+std::string v4l2::device() const
+{
+    return m->device;
+}
+
 size_t v4l2::image_size() const
 {
     return m->fmt.sizeimage;
@@ -486,23 +1090,78 @@ bool v4l2::start(size_t width_hint, size_t height_hint, unsigned pixel_format, s
     if (m->fd < 0)
         return false;
 
+    // The cheapest mode that covers the size and the rate, the driver adjusts the hints if they are not enumerated.
+    v4l2_mode mode;
+    mode.width = width_hint;
+    mode.height = height_hint;
+    mode.pixel_format = pixel_format;
+    if (m->fps) {
+        mode.interval_numerator = 1;
+        mode.interval_denominator = m->fps;
+    }
+    choose_mode(enum_modes(m->fd, width_hint, height_hint, m->fps), width_hint, height_hint, m->fps, pixel_format, mode);
+    if (m->fps && !mode.interval_numerator) {
+        mode.interval_numerator = 1;
+        mode.interval_denominator = m->fps;
+    }
+
     v4l2_format fmt;
-    if (!init_device(m->fd, m->device, width_hint, height_hint, pixel_format, &fmt)) {
+    if (!init_device(m->fd, m->device, mode.width, mode.height, mode.pixel_format, &fmt)) {
         close_device(m->fd);
         return false;
     }
 
+    CLEAR(m->plane_formats);
+    m->queue = Queue();
+    m->queue.fd = m->fd;
+    m->queue.type = fmt.type;
+    if (fmt.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        auto &mp = fmt.fmt.pix_mp;
+        CLEAR(m->fmt);
+        m->fmt.width = mp.width;
+        m->fmt.height = mp.height;
+        m->fmt.pixelformat = mp.pixelformat;
+        m->fmt.field = mp.field;
+        m->fmt.bytesperline = mp.plane_fmt[0].bytesperline;
+        for (unsigned p = 0; p < mp.num_planes; ++p) {
+            m->plane_formats[p] = mp.plane_fmt[p];
+            m->fmt.sizeimage += mp.plane_fmt[p].sizeimage;
+        }
+        m->queue.planes = mp.num_planes;
+    } else {
+        m->fmt = fmt.fmt.pix;
+        m->plane_formats[0].sizeimage = m->fmt.sizeimage;
+        m->plane_formats[0].bytesperline = m->fmt.bytesperline;
+    }
+
+    mode.pixel_format = m->fmt.pixelformat;
+    mode.width = m->fmt.width;
+    mode.height = m->fmt.height;
+    set_frame_interval(m->fd, fmt.type, mode);
+    m->mode = mode;
+
     m->requested_pixel_format = pixel_format;
-    m->fmt = fmt.fmt.pix;
-    m->buffers_count = buffers_count;
-    m->buffers = init_mmap(m->fd, m->device, m->buffers_count);
-    if (!m->buffers) {
+    m->counters = Counters();
+    bool ok = false;
+    if (m->memory == memory_mmap) {
+        ok = init_mmap(m->queue, m->device, buffers_count);
+    } else {
+        size_t sizes[VIDEO_MAX_PLANES];
+        for (unsigned p = 0; p < m->queue.planes; ++p)
+            sizes[p] = m->plane_formats[p].sizeimage;
+        ok = init_userptr(m->queue, m->device, buffers_count, sizes, m->memory == memory_hugepages);
+    }
+    if (!ok) {
         close_device(m->fd);
         return false;
     }
 
-    if (!start_capturing(m->fd, m->buffers_count)) {
-        uninit_device(&m->buffers, m->buffers_count);
+    // Application memory is not exported by the driver.
+    if (m->dmabuf_export && m->memory == memory_mmap && !export_buffers(m->queue))
+        fprintf(stderr, "%s: frames are not exported as DMABUF\n", m->device.c_str());
+
+    if (!start_capturing(m->queue)) {
+        uninit_device(m->queue);
         close_device(m->fd);
         return false;
     }
@@ -516,8 +1175,9 @@ void v4l2::stop()
     if (!m->active)
         return;
 
-    stop_capturing(m->fd);
-    uninit_device(&m->buffers, m->buffers_count);
+    m->held = -1;
+    stop_capturing(m->queue);
+    uninit_device(m->queue);
     close_device(m->fd);
     m->active = false;
 }
@@ -527,9 +1187,69 @@ bool v4l2::is_active() const
     return m->active;
 }
 
+void v4l2::set_frame_rate(unsigned fps)
+{
+    m->fps = fps;
+}
+
+void v4l2::set_memory(memory_type memory)
+{
+    m->memory = memory;
+}
+
+v4l2::memory_type v4l2::memory() const
+{
+    return m->memory;
+}
+
+void v4l2::set_dmabuf_export(bool enable)
+{
+    m->dmabuf_export = enable;
+}
+
+std::vector<v4l2_mode> v4l2::modes() const
+{
+    if (m->fd >= 0)
+        return enum_modes(m->fd, 0, 0, 0);
+
+    int fd = open_device(m->device);
+    if (fd < 0)
+        return std::vector<v4l2_mode>();
+
+    auto r = enum_modes(fd, 0, 0, 0);
+    close_device(fd);
+    return r;
+}
+
+v4l2_mode v4l2::mode() const
+{
+    return m->mode;
+}
+
+void v4l2::set_latest_only(bool latest)
+{
+    m->latest_only = latest;
+}
+
+size_t v4l2::frames_skipped() const
+{
+    return m->counters.stats.skipped;
+}
+
+v4l2_stats v4l2::stats() const
+{
+    return m->counters.stats;
+}
+
 v4l2_frame v4l2::read_frame() const
 {
     v4l2_frame frame;
+    // The previous frame is not used anymore.
+    if (m->held >= 0) {
+        queue_buffer(m->queue, m->held);
+        m->held = -1;
+    }
+
     while (m->active) {
         fd_set fds;
         struct timeval tv;
@@ -554,17 +1274,9 @@ v4l2_frame v4l2::read_frame() const
             break;
         }
 
-        auto buf = ::read_frame(m->fd);
-        if (buf.bytesused) {
-            frame.m->width = m->fmt.width;
-            frame.m->height = m->fmt.height;
-            frame.m->pixel_format = m->fmt.pixelformat;
-            frame.m->timestamp = buf.timestamp;
-            frame.m->size = buf.bytesused;
-            frame.m->data = (unsigned char *)((Buffer *)m->buffers)[buf.index].start;
-
+        frame = try_read_frame();
+        if (frame)
             return frame;
-        }
 
         if (errno == ENODEV)
             break;
@@ -575,4 +1287,57 @@ v4l2_frame v4l2::read_frame() const
     return frame;
 }
 
+v4l2_frame v4l2::try_read_frame() const
+{
+    v4l2_frame frame;
+    if (!m->active)
+        return frame;
+
+    if (m->held >= 0) {
+        queue_buffer(m->queue, m->held);
+        m->held = -1;
+    }
+
+    auto buf = m->latest_only ? read_latest_frame(m->queue, m->counters) : ::read_frame(m->queue, m->counters);
+    if (!buf.bytesused)
+        return frame;
+
+    ++m->counters.stats.frames;
+    count_latency(m->counters, buf);
+    if (m->latest_only)
+        m->held = buf.index;
+    frame.m->width = m->fmt.width;
+    frame.m->height = m->fmt.height;
+    frame.m->pixel_format = m->fmt.pixelformat;
+    frame.m->timestamp = buf.timestamp;
+    frame.m->sequence = buf.sequence;
+    frame.m->flags = buf.flags;
+    frame.m->set_planes(m->queue.buffers[buf.index], m->queue, m->plane_formats);
+    return frame;
+}
+
+int v4l2::fd() const
+{
+    return m->active ? m->fd : -1;
+}
+
+void v4l2::set_callback(const frame_callback &cb)
+{
+    m->callback = cb;
+}
+
+bool v4l2::on_readable()
+{
+    while (m->active) {
+        auto frame = try_read_frame();
+        if (!frame)
+            return errno != ENODEV;
+
+        if (m->callback)
+            m->callback(frame);
+    }
+
+    return false;
+}
+
 } // Capture